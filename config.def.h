@@ -43,6 +43,16 @@ static Color colors[] = {
 #define NMASTER 1
 /* scroll back buffer size in lines */
 #define SCROLL_HISTORY 500
+/* directory to which cold scroll back history is spilled instead of being
+ * kept in memory, e.g. getenv("XDG_RUNTIME_DIR"), NULL to disable */
+#define SCROLL_SPILL_DIR NULL
+/* bytes of memory the scroll back history of all windows may take together,
+ * the windows viewed least recently lose their oldest lines first, 0 for no limit */
+#define SCROLL_BUDGET 0
+/* maximal number of bytes read from a window before the others are served */
+#define READ_BUDGET (256 * 1024)
+/* maximal number of screen updates per second */
+#define FRAME_RATE 60
 /* printf format string for the tag in the status bar */
 #define TAG_SYMBOL   "[%s]"
 /* curses attributes for the currently selected tags */
@@ -191,7 +201,8 @@ static Button buttons[] = {
 #endif /* CONFIG_MOUSE */
 
 static Cmd commands[] = {
-	/* create [cmd]: create a new window, run `cmd` in the shell if specified */
+	/* create [cmd] [title] [cwd] [budget]: create a new window, run `cmd` in the shell if specified,
+	 * an empty `cwd` keeps the current one, `budget` limits the memory of its own history (e.g. 16M) */
 	{ "create", { create,	{ NULL } } },
 	/* focus <win_id>: focus the window whose `DVTM_WINDOW_ID` is `win_id` */
 	{ "focus",  { focusid,	{ NULL } } },
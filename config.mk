@@ -9,6 +9,10 @@ TERMINFO := ${DESTDIR}${PREFIX}/share/terminfo
 INCS = -I.
 LIBS = -lc -lutil -lncursesw
 CPPFLAGS = -D_POSIX_C_SOURCE=200809L -D_XOPEN_SOURCE=700 -D_XOPEN_SOURCE_EXTENDED
+
+# uncomment to compress the scroll back buffer with zlib
+#CPPFLAGS += -DHAVE_ZLIB
+#LIBS += -lz
 CFLAGS += -std=c99 ${INCS} -DNDEBUG ${CPPFLAGS}
 
 CC ?= cc
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <time.h>
 #include <locale.h>
 #include <string.h>
 #include <unistd.h>
@@ -36,6 +37,10 @@
 #if defined __CYGWIN__ || defined __sun
 # include <termios.h>
 #endif
+#ifdef __linux__
+# include <sys/epoll.h>
+# include <sys/signalfd.h>
+#endif
 #include "vt.h"
 
 #ifdef PDCURSES
@@ -50,6 +55,7 @@ typedef struct {
 	float mfact;
 	unsigned int nmaster;
 	int history;
+	size_t history_budget;
 	int w;
 	int h;
 	volatile sig_atomic_t need_resize;
@@ -79,10 +85,12 @@ struct Client {
 	bool has_title_line;
 	bool minimized;
 	bool urgent;
+	bool damaged;
 	volatile sig_atomic_t died;
 	Client *next;
 	Client *prev;
 	Client *snext;
+	Client *dnext;
 	unsigned int tags;
 };
 
@@ -113,7 +121,7 @@ typedef struct {
 
 typedef struct {
 	void (*cmd)(const char *args[]);
-	const char *args[3];
+	const char *args[4];
 } Action;
 
 #define MAX_KEYS 3
@@ -233,7 +241,8 @@ static char *title;
 
 /* global variables */
 static const char *dvtm_name = "dvtm";
-Screen screen = { .mfact = MFACT, .nmaster = NMASTER, .history = SCROLL_HISTORY };
+Screen screen = { .mfact = MFACT, .nmaster = NMASTER, .history = SCROLL_HISTORY,
+                   .history_budget = SCROLL_BUDGET };
 static Client *stack = NULL;
 static Client *sel = NULL;
 static Client *lastsel = NULL;
@@ -247,7 +256,14 @@ static CmdFifo cmdfifo = { .fd = -1 };
 static const char *shell;
 static Register copyreg;
 static volatile sig_atomic_t running = true;
+static volatile sig_atomic_t clients_died;
 static bool runinall = false;
+static Client *damage;            /* clients whose content changed since the last frame */
+static struct timespec frame_next; /* earliest time at which the next frame may be drawn */
+#ifdef __linux__
+static int epfd = -1;  /* epoll instance all input sources are registered with */
+static int sigfd = -1; /* SIGCHLD and SIGWINCH are read from here */
+#endif
 
 static void
 eprint(const char *errstr, ...) {
@@ -266,6 +282,24 @@ error(const char *errstr, ...) {
 	exit(EXIT_FAILURE);
 }
 
+/* data is returned on readiness: a Vt, NULL for stdin or the address of the fd */
+static void
+watch(int fd, void *data) {
+#ifdef __linux__
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = data };
+	if (fd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		eprint("epoll_ctl: %s\n", strerror(errno));
+#endif
+}
+
+static void
+unwatch(int fd) {
+#ifdef __linux__
+	if (fd != -1)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+
 static bool
 isarrange(void (*func)()) {
 	return func == layout->arrange;
@@ -495,6 +529,10 @@ arrange(void) {
 		wah++;
 	}
 	focus(NULL);
+	for (Client *c = clients; c; c = c->next) {
+		if (!is_content_visible(c))
+			vt_hide(c->term);
+	}
 	wnoutrefresh(stdscr);
 	drawbar();
 	draw_all();
@@ -581,12 +619,15 @@ focus(Client *c) {
 		if (!isarrange(fullscreen)) {
 			draw_border(lastsel);
 			wnoutrefresh(lastsel->window);
+		} else {
+			vt_hide(lastsel->term);
 		}
 	}
 
 	if (c) {
 		detachstack(c);
 		attachstack(c);
+		vt_viewed(c->app);
 		settitle(c);
 		c->urgent = false;
 		if (isarrange(fullscreen)) {
@@ -630,6 +671,16 @@ term_title_handler(Vt *term, const char *title) {
 	applycolorrules(c);
 }
 
+static void
+term_damage_handler(Vt *term) {
+	Client *c = (Client *)vt_data_get(term);
+	if (c->damaged)
+		return;
+	c->damaged = true;
+	c->dnext = damage;
+	damage = c;
+}
+
 static void
 term_urgent_handler(Vt *term) {
 	Client *c = (Client *)vt_data_get(term);
@@ -717,10 +768,12 @@ sigchld_handler(int sig) {
 		for (Client *c = clients; c; c = c->next) {
 			if (c->pid == pid) {
 				c->died = true;
+				clients_died = true;
 				break;
 			}
 			if (c->editor && vt_pid_get(c->editor) == pid) {
 				c->editor_died = true;
+				clients_died = true;
 				break;
 			}
 		}
@@ -952,6 +1005,9 @@ setup(void) {
 	raw();
 	vt_init();
 	vt_keytable_set(keytable, LENGTH(keytable));
+	vt_read_budget_set(READ_BUDGET);
+	vt_spill_dir_set(SCROLL_SPILL_DIR);
+	vt_history_budget_set(screen.history_budget);
 	for (unsigned int i = 0; i < LENGTH(colors); i++) {
 		if (COLORS == 256) {
 			if (colors[i].fg256)
@@ -974,6 +1030,10 @@ setup(void) {
 	sigaction(SIGTERM, &sa, NULL);
 	sa.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &sa, NULL);
+#ifdef __linux__
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		error("epoll_create1: %s\n", strerror(errno));
+#endif
 }
 
 static void
@@ -993,8 +1053,15 @@ destroy(Client *c) {
 	}
 	if (lastsel == c)
 		lastsel = NULL;
+	for (Client **d = &damage; *d; d = &(*d)->dnext) {
+		if (*d == c) {
+			*d = c->dnext;
+			break;
+		}
+	}
 	werase(c->window);
 	wnoutrefresh(c->window);
+	unwatch(vt_pty_get(c->term));
 	vt_destroy(c->term);
 	delwin(c->window);
 	if (!clients && LENGTH(actions)) {
@@ -1024,6 +1091,34 @@ cleanup(void) {
 		unlink(cmdfifo.file);
 }
 
+/* parses a number of bytes with an optional K, M or G suffix */
+static bool
+parse_size(const char *s, size_t *size) {
+	char *end;
+	unsigned long n;
+	int shift = 0;
+
+	if (*s < '0' || *s > '9')
+		return false;
+	errno = 0;
+	n = strtoul(s, &end, 10);
+	switch (*end) {
+	case 'G': case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M': case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K': case 'k':
+		shift += 10;
+		end++;
+	}
+	if (errno || *end || n > SIZE_MAX >> shift)
+		return false;
+	*size = (size_t)n << shift;
+	return true;
+}
+
 static char *getcwd_by_pid(Client *c) {
 	if (!c)
 		return NULL;
@@ -1040,7 +1135,12 @@ create(const char *args[]) {
 		"DVTM_WINDOW_ID", buf,
 		NULL
 	};
+	size_t limit = 0;
 
+	if (args && args[3] && !parse_size(args[3], &limit)) {
+		eprint("dvtm: invalid history size: %s\n", args[3]);
+		return;
+	}
 	if (args && args[0]) {
 		pargs[1] = "-c";
 		pargs[2] = args[0];
@@ -1065,6 +1165,9 @@ create(const char *args[]) {
 		return;
 	}
 
+	if (args && args[3])
+		vt_history_limit_set(c->term, limit);
+
 	if (args && args[0]) {
 		c->cmd = args[0];
 		char name[PATH_MAX];
@@ -1079,14 +1182,16 @@ create(const char *args[]) {
 		strncpy(c->title, args[1], sizeof(c->title));
 	c->title[sizeof(c->title)-1] = '\0';
 
-	if (args && args[2])
+	if (args && args[2] && *args[2])
 		cwd = !strcmp(args[2], "$CWD") ? getcwd_by_pid(sel) : (char*)args[2];
 	c->pid = vt_forkpty(c->term, shell, pargs, cwd, env, NULL, NULL);
 	if (args && args[2] && !strcmp(args[2], "$CWD"))
 		free(cwd);
 	vt_data_set(c->term, c);
+	watch(vt_pty_get(c->term), c->term);
 	vt_title_handler_set(c->term, term_title_handler);
 	vt_urgent_handler_set(c->term, term_urgent_handler);
+	vt_damage_handler_set(c->term, term_damage_handler);
 	applycolorrules(c);
 	c->x = wax;
 	c->y = way;
@@ -1103,6 +1208,8 @@ copymode(const char *args[]) {
 
 	bool colored = strstr(args[0], "pager") != NULL;
 
+	vt_viewed(sel->app);
+
 	if (!(sel->editor = vt_create(sel->h - sel->has_title_line, sel->w, 0)))
 		return;
 
@@ -1123,6 +1230,11 @@ copymode(const char *args[]) {
 	}
 
 	sel->term = sel->editor;
+	vt_hide(sel->app);
+	vt_data_set(sel->editor, sel);
+	vt_damage_handler_set(sel->editor, term_damage_handler);
+	unwatch(vt_pty_get(sel->app));
+	watch(vt_pty_get(sel->editor), sel->editor);
 
 	if (sel->editor_fds[0] != -1) {
 		char *buf = NULL;
@@ -1321,6 +1433,7 @@ scrollback(const char *args[]) {
 	if (!is_content_visible(sel))
 		return;
 
+	vt_viewed(sel->app);
 	if (!args[0] || atoi(args[0]) < 0)
 		vt_scroll(sel->term, -sel->h/2);
 	else
@@ -1542,6 +1655,7 @@ handle_cmdfifo(void) {
 
 	r = read(cmdfifo.fd, cmdbuf, sizeof cmdbuf - 1);
 	if (r <= 0) {
+		unwatch(cmdfifo.fd);
 		cmdfifo.fd = -1;
 		return;
 	}
@@ -1662,9 +1776,11 @@ handle_statusbar(void) {
 		case -1:
 			strncpy(bar.text, strerror(errno), sizeof bar.text - 1);
 			bar.text[sizeof bar.text - 1] = '\0';
+			unwatch(bar.fd);
 			bar.fd = -1;
 			break;
 		case 0:
+			unwatch(bar.fd);
 			bar.fd = -1;
 			break;
 		default:
@@ -1703,14 +1819,233 @@ handle_editor(Client *c) {
 	}
 	c->editor_died = false;
 	c->editor_fds[1] = -1;
+	unwatch(vt_pty_get(c->editor));
 	vt_destroy(c->editor);
 	c->editor = NULL;
 	c->term = c->app;
+	watch(vt_pty_get(c->term), c->term);
 	vt_dirty(c->term);
 	draw_content(c);
 	wnoutrefresh(c->window);
 }
 
+static void
+frame_schedule(struct timespec *now, long delay) {
+	frame_next = *now;
+	frame_next.tv_nsec += delay;
+	while (frame_next.tv_nsec >= 1000000000L) {
+		frame_next.tv_sec++;
+		frame_next.tv_nsec -= 1000000000L;
+	}
+}
+
+static void
+frame_draw(void) {
+	Client *list = damage;
+	damage = NULL;
+
+	for (Client *c = list, *next; c; c = next) {
+		/* drawing may damage clients again, which relinks them */
+		next = c->dnext;
+		c->damaged = false;
+		if (c != sel && is_content_visible(c)) {
+			draw_content(c);
+			wnoutrefresh(c->window);
+		}
+	}
+
+	/* refreshed last to leave the cursor in the focused window */
+	if (is_content_visible(sel)) {
+		draw_content(sel);
+		curs_set(vt_cursor_visible(sel->term));
+		wnoutrefresh(sel->window);
+	}
+}
+
+/* draws the pending frame once it is due, returns the time left otherwise */
+static struct timespec *
+frame_timeout(struct timespec *timeout) {
+	struct timespec now;
+
+	if (!damage)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timeout->tv_sec = frame_next.tv_sec - now.tv_sec;
+	timeout->tv_nsec = frame_next.tv_nsec - now.tv_nsec;
+	if (timeout->tv_nsec < 0) {
+		timeout->tv_sec--;
+		timeout->tv_nsec += 1000000000L;
+	}
+
+	if (timeout->tv_sec < 0) {
+		frame_draw();
+		frame_schedule(&now, 1000000000L / FRAME_RATE);
+		return NULL;
+	}
+
+	return timeout;
+}
+
+static void
+handle_keyboard(void) {
+	static KeyCombo keys;
+	static unsigned int key_index;
+	struct timespec now;
+
+	/* draw the reaction to user input without delay */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	frame_schedule(&now, 0);
+
+	int code = getch();
+	if (code < 0)
+		return;
+	keys[key_index++] = code;
+	KeyBinding *binding = NULL;
+	if (code == KEY_MOUSE) {
+		key_index = 0;
+		handle_mouse();
+	} else if ((binding = keybinding(keys, key_index))) {
+		unsigned int key_length = MAX_KEYS;
+		while (key_length > 1 && !binding->keys[key_length-1])
+			key_length--;
+		if (key_index == key_length) {
+			binding->action.cmd(binding->action.args);
+			key_index = 0;
+			memset(keys, 0, sizeof(keys));
+		}
+	} else {
+		key_index = 0;
+		memset(keys, 0, sizeof(keys));
+		keypress(code);
+	}
+}
+
+static void
+handle_pty(Vt *term) {
+	Client *c = vt_data_get(term);
+	if (term != c->term)
+		return;
+	if (vt_process(term) < 0 && errno == EIO) {
+		if (c->editor)
+			c->editor_died = true;
+		else
+			c->died = true;
+		clients_died = true;
+	}
+}
+
+#ifdef __linux__
+static void
+handle_signals(void) {
+	struct signalfd_siginfo info;
+	while (read(sigfd, &info, sizeof info) == sizeof info) {
+		if (info.ssi_signo == SIGCHLD)
+			sigchld_handler(SIGCHLD);
+		else if (info.ssi_signo == SIGWINCH)
+			sigwinch_handler(SIGWINCH);
+	}
+}
+
+static void
+events_init(sigset_t *signals) {
+	if ((sigfd = signalfd(-1, signals, SFD_NONBLOCK|SFD_CLOEXEC)) == -1)
+		error("signalfd: %s\n", strerror(errno));
+	watch(sigfd, &sigfd);
+	watch(STDIN_FILENO, NULL);
+	watch(cmdfifo.fd, &cmdfifo.fd);
+	watch(bar.fd, &bar.fd);
+}
+
+static void
+events_wait(struct timespec *timeout) {
+	struct epoll_event events[64];
+	int ms = -1;
+
+	if (timeout)
+		ms = timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+
+	int n = epoll_wait(epfd, events, LENGTH(events), ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		perror("epoll_wait()");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < n; i++) {
+		void *data = events[i].data.ptr;
+		if (!data)
+			handle_keyboard();
+		else if (data == &sigfd)
+			handle_signals();
+		else if (data == &cmdfifo.fd)
+			handle_cmdfifo();
+		else if (data == &bar.fd)
+			handle_statusbar();
+		else
+			handle_pty(data);
+	}
+}
+#else
+static void
+events_init(sigset_t *signals) {
+}
+
+static void
+events_wait(struct timespec *timeout) {
+	int r, nfds = 0;
+	sigset_t emptyset;
+	fd_set rd;
+
+	FD_ZERO(&rd);
+	FD_SET(STDIN_FILENO, &rd);
+
+	if (cmdfifo.fd != -1) {
+		FD_SET(cmdfifo.fd, &rd);
+		nfds = cmdfifo.fd;
+	}
+
+	if (bar.fd != -1) {
+		FD_SET(bar.fd, &rd);
+		nfds = MAX(nfds, bar.fd);
+	}
+
+	for (Client *c = clients; c; c = c->next) {
+		int pty = vt_pty_get(c->term);
+		FD_SET(pty, &rd);
+		nfds = MAX(nfds, pty);
+	}
+
+	sigemptyset(&emptyset);
+	r = pselect(nfds + 1, &rd, NULL, NULL, timeout, &emptyset);
+
+	if (r < 0) {
+		if (errno == EINTR)
+			return;
+		perror("select()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (FD_ISSET(STDIN_FILENO, &rd)) {
+		handle_keyboard();
+		if (r == 1) /* no data available on pty's */
+			return;
+	}
+
+	if (cmdfifo.fd != -1 && FD_ISSET(cmdfifo.fd, &rd))
+		handle_cmdfifo();
+
+	if (bar.fd != -1 && FD_ISSET(bar.fd, &rd))
+		handle_statusbar();
+
+	for (Client *c = clients; c; c = c->next) {
+		if (FD_ISSET(vt_pty_get(c->term), &rd))
+			handle_pty(c->term);
+	}
+}
+#endif
+
 static int
 open_or_create_fifo(const char *name, const char **name_created) {
 	struct stat info;
@@ -1736,7 +2071,7 @@ open_or_create_fifo(const char *name, const char **name_created) {
 static void
 usage(void) {
 	cleanup();
-	eprint("usage: dvtm [-v] [-M] [-m mod] [-d delay] [-h lines] [-t title] "
+	eprint("usage: dvtm [-v] [-M] [-m mod] [-d delay] [-h lines] [-H bytes] [-t title] "
 	       "[-s status-fifo] [-c cmd-fifo] [cmd...]\n");
 	exit(EXIT_FAILURE);
 }
@@ -1752,7 +2087,7 @@ parse_args(int argc, char *argv[]) {
 		set_escdelay(100);
 	for (int arg = 1; arg < argc; arg++) {
 		if (argv[arg][0] != '-') {
-			const char *args[] = { argv[arg], NULL, NULL };
+			const char *args[] = { argv[arg], NULL, NULL, NULL };
 			if (!init) {
 				setup();
 				init = true;
@@ -1788,6 +2123,10 @@ parse_args(int argc, char *argv[]) {
 			case 'h':
 				screen.history = atoi(argv[++arg]);
 				break;
+			case 'H':
+				if (!parse_size(argv[++arg], &screen.history_budget))
+					usage();
+				break;
 			case 't':
 				title = argv[++arg];
 				break;
@@ -1812,10 +2151,7 @@ parse_args(int argc, char *argv[]) {
 
 int
 main(int argc, char *argv[]) {
-	KeyCombo keys;
-	unsigned int key_index = 0;
-	memset(keys, 0, sizeof(keys));
-	sigset_t emptyset, blockset;
+	sigset_t blockset;
 
 	setenv("DVTM", VERSION, 1);
 	if (!parse_args(argc, argv)) {
@@ -1823,114 +2159,45 @@ main(int argc, char *argv[]) {
 		startup(NULL);
 	}
 
-	sigemptyset(&emptyset);
 	sigemptyset(&blockset);
 	sigaddset(&blockset, SIGWINCH);
 	sigaddset(&blockset, SIGCHLD);
 	sigprocmask(SIG_BLOCK, &blockset, NULL);
+	events_init(&blockset);
 
 	while (running) {
-		int r, nfds = 0;
-		fd_set rd;
+		struct timespec timeout;
 
 		if (screen.need_resize) {
 			resize_screen();
 			screen.need_resize = false;
 		}
 
-		FD_ZERO(&rd);
-		FD_SET(STDIN_FILENO, &rd);
-
-		if (cmdfifo.fd != -1) {
-			FD_SET(cmdfifo.fd, &rd);
-			nfds = cmdfifo.fd;
-		}
-
-		if (bar.fd != -1) {
-			FD_SET(bar.fd, &rd);
-			nfds = MAX(nfds, bar.fd);
-		}
-
-		for (Client *c = clients; c; ) {
-			if (c->editor && c->editor_died)
-				handle_editor(c);
-			if (!c->editor && c->died) {
-				Client *t = c->next;
-				destroy(c);
-				c = t;
-				continue;
-			}
-			int pty = c->editor ? vt_pty_get(c->editor) : vt_pty_get(c->app);
-			FD_SET(pty, &rd);
-			nfds = MAX(nfds, pty);
-			c = c->next;
-		}
-
-		doupdate();
-		r = pselect(nfds + 1, &rd, NULL, NULL, NULL, &emptyset);
-
-		if (r < 0) {
-			if (errno == EINTR)
-				continue;
-			perror("select()");
-			exit(EXIT_FAILURE);
-		}
-
-		if (FD_ISSET(STDIN_FILENO, &rd)) {
-			int code = getch();
-			if (code >= 0) {
-				keys[key_index++] = code;
-				KeyBinding *binding = NULL;
-				if (code == KEY_MOUSE) {
-					key_index = 0;
-					handle_mouse();
-				} else if ((binding = keybinding(keys, key_index))) {
-					unsigned int key_length = MAX_KEYS;
-					while (key_length > 1 && !binding->keys[key_length-1])
-						key_length--;
-					if (key_index == key_length) {
-						binding->action.cmd(binding->action.args);
-						key_index = 0;
-						memset(keys, 0, sizeof(keys));
-					}
-				} else {
-					key_index = 0;
-					memset(keys, 0, sizeof(keys));
-					keypress(code);
-				}
-			}
-			if (r == 1) /* no data available on pty's */
-				continue;
-		}
-
-		if (cmdfifo.fd != -1 && FD_ISSET(cmdfifo.fd, &rd))
-			handle_cmdfifo();
-
-		if (bar.fd != -1 && FD_ISSET(bar.fd, &rd))
-			handle_statusbar();
-
-		for (Client *c = clients; c; c = c->next) {
-			if (FD_ISSET(vt_pty_get(c->term), &rd)) {
-				if (vt_process(c->term) < 0 && errno == EIO) {
-					if (c->editor)
-						c->editor_died = true;
-					else
-						c->died = true;
+		if (clients_died) {
+			clients_died = false;
+			for (Client *c = clients; c; ) {
+				if (c->editor && c->editor_died)
+					handle_editor(c);
+				if (!c->editor && c->died) {
+					Client *t = c->next;
+					destroy(c);
+					c = t;
 					continue;
 				}
-			}
-
-			if (c != sel && is_content_visible(c)) {
-				draw_content(c);
-				wnoutrefresh(c->window);
+				c = c->next;
 			}
 		}
 
-		if (is_content_visible(sel)) {
-			draw_content(sel);
-			curs_set(vt_cursor_visible(sel->term));
-			wnoutrefresh(sel->window);
+		struct timespec *wait = frame_timeout(&timeout);
+		int idle = vt_idle();
+		if (!wait && idle >= 0) {
+			/* wake up to release what the terminals no longer need */
+			timeout.tv_sec = idle;
+			timeout.tv_nsec = 0;
+			wait = &timeout;
 		}
+		doupdate();
+		events_wait(wait);
 	}
 
 	cleanup();
@@ -4,6 +4,8 @@ MOD="" # CTRL+g
 ESC="" # \e
 DVTM="./dvtm"
 export DVTM_EDITOR="vis"
+export DVTM_PAGER="$(pwd)/dvtm-test-pager"
+export PATH="$(cd "$(dirname "$0")" && pwd):$PATH"
 LOG="dvtm.log"
 TEST_LOG="$0.log"
 UTF8_TEST_URL="http://www.cl.cam.ac.uk/~mgk25/ucs/examples/UTF-8-demo.txt"
@@ -40,22 +42,43 @@ test_copymode() { # requires wget, diff, vis
 	dvtm_cmd 'p'
 	sh_cmd 'EOF'
 	while [ ! -r "$COPY" ]; do sleep 1; done;
-	dvtm_input "exit\n"
 	diff -u "$FILENAME" "$COPY" 1>&2
 	local RESULT=$?
 	rm -f "$COPY"
 	return $RESULT
 }
 
-if ! which vis > /dev/null 2>&1 ; then
-	echo "vis not found, skiping copymode test"
-	exit 0
-fi
+test_attributes() { # requires dvtm-pager
+	local COPY="attributes.copy"
+	local DONE="attributes.done"
+	local RESULT=0
+	printf '#!/bin/sh\ncat > "%s"\n' "$(pwd)/$COPY" > "$DVTM_PAGER"
+	chmod +x "$DVTM_PAGER"
+	sh_cmd 'clear; for a in 1 2 3 4 5 7 8; do printf "\\033[${a}m$a\\033[0m "; done; printf "\\033[4:3mc\\033[0m \\033[58:5:1mu\\033[0m"; echo; touch '"$DONE"
+	while [ ! -e "$DONE" ]; do sleep 1; done;
+	dvtm_cmd 'E'
+	while [ ! -s "$COPY" ]; do sleep 1; done;
+	sleep 1
+	for a in 1 2 3 4 5 7 8; do
+		grep -qF "${ESC}[0;${a}m" "$COPY" || { echo "SGR $a lost" 1>&2; RESULT=1; }
+	done
+	# sub parameters are not taken as attributes of their own
+	grep -qF "${ESC}[0;4m${ESC}[39m${ESC}[49mc" "$COPY" || { echo "SGR 4:3 not an underline" 1>&2; RESULT=1; }
+	grep -qF "${ESC}[0;1;5m" "$COPY" && { echo "SGR 58:5:1 taken as 1 and 5" 1>&2; RESULT=1; }
+	rm -f "$COPY" "$DONE" "$DVTM_PAGER"
+	return $RESULT
+}
 
 {
 	echo "Testing $DVTM" 1>&2
 	$DVTM -v 1>&2
-	test_copymode && echo "copymode: OK" 1>&2 || echo "copymode: FAIL" 1>&2;
+	test_attributes && echo "attributes: OK" 1>&2 || echo "attributes: FAIL" 1>&2;
+	if which vis > /dev/null 2>&1 ; then
+		test_copymode && echo "copymode: OK" 1>&2 || echo "copymode: FAIL" 1>&2;
+	else
+		echo "vis not found, skipping copymode test" 1>&2
+	fi
+	dvtm_input "exit\n"
 } 2> "$TEST_LOG" | $DVTM -m ^g 2> $LOG
 
 cat "$TEST_LOG" && rm "$TEST_LOG" $LOG
@@ -23,15 +23,26 @@
 #include <fcntl.h>
 #include <langinfo.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <wchar.h>
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+#ifdef __AVX2__
+# include <immintrin.h>
+#elif defined __SSE2__
+# include <emmintrin.h>
+#endif
 #if defined(__linux__) || defined(__CYGWIN__)
 # include <pty.h>
 #elif defined(__FreeBSD__) || defined(__DragonFly__)
@@ -52,6 +63,24 @@
 # define NCURSES_ATTR_SHIFT 8
 #endif
 
+#ifdef NCURSES_VERSION
+# define CELL_ATTR_SHIFT (NCURSES_ATTR_SHIFT + 8) /* also drop the always empty color pair */
+#else
+# define CELL_ATTR_SHIFT NCURSES_ATTR_SHIFT
+#endif
+
+#ifndef A_ITALIC
+# define A_ITALIC 0
+#endif
+
+/* A_ITALIC lies beyond the attribute bits kept in a cell, it is stored in
+ * place of A_HORIZONTAL which is never set by an escape sequence */
+#ifdef A_HORIZONTAL
+# define CELL_ITALIC (A_HORIZONTAL >> CELL_ATTR_SHIFT)
+#else
+# define CELL_ITALIC 0
+#endif
+
 #ifndef NCURSES_ACS
 # ifdef PDCURSES
 #  define NCURSES_ACS(c) (acs_map[(unsigned char)(c)])
@@ -71,6 +100,10 @@
 #ifndef MAX_COLOR_PAIRS
 # define MAX_COLOR_PAIRS COLOR_PAIRS
 #endif
+#if NCURSES_EXT_COLORS && (NCURSES_VERSION_MAJOR > 6 || \
+    (NCURSES_VERSION_MAJOR == 6 && NCURSES_VERSION_MINOR >= 1))
+# define HAVE_EXTENDED_PAIRS 1 /* color pairs with int colors */
+#endif
 
 #if defined _AIX && defined CTRL
 # undef CTRL
@@ -80,75 +113,218 @@
 #endif
 
 #define IS_CONTROL(ch) !((ch) & 0xffffff60UL)
+#define RGB_COLOR 0x1000000 /* colors with this bit set are 24-bit RGB values */
+#define CELL_COLOR_DEFAULT 0 /* packed cell colors, see color_pack */
+#define CELL_COLOR_RGB 257
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define LENGTH(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define ALTERNATE_LINGER 10 /* seconds the alternate screen buffer is kept after it was left */
 
-static bool is_utf8, has_default_colors;
-static short color_pairs_reserved, color_pairs_max, color_pair_current;
-static short *color2palette, default_fg, default_bg;
+static bool is_utf8, has_default_colors, has_direct_colors;
+static short color_pairs_max, default_fg, default_bg;
+static short color_pairs_used; /* pairs [1, color_pairs_used] have been initialized */
+static unsigned int color_generation = 1; /* incremented whenever a color pair is reassigned */
 static char vt_term[32];
+static size_t read_budget = 256 * 1024;
+static const char *spill_dir;
+static size_t history_budget;    /* bytes the history of all terminals may take, 0 for no limit */
+static size_t history_total;     /* bytes taken by the history of those sharing history_budget */
+static unsigned long view_clock; /* stamps terminals the user interacts with */
+
+/* states of the escape sequence parser, these follow the state diagram of
+ * the DEC VT500 series terminals as documented by Paul Williams at
+ * https://vt100.net/emu/dec_ansi_parser
+ */
+enum {
+	STATE_GROUND,
+	STATE_ESCAPE,
+	STATE_ESCAPE_INTERMEDIATE,
+	STATE_CSI_ENTRY,
+	STATE_CSI_PARAM,
+	STATE_CSI_INTERMEDIATE,
+	STATE_CSI_IGNORE,
+	STATE_DCS_ENTRY,
+	STATE_DCS_PARAM,
+	STATE_DCS_INTERMEDIATE,
+	STATE_DCS_PASSTHROUGH,
+	STATE_DCS_IGNORE,
+	STATE_OSC_STRING,
+	STATE_SOS_PM_APC_STRING,
+	STATE_COUNT,
+};
 
 typedef struct {
-	wchar_t text;
-	attr_t attr;
-	short fg;
-	short bg;
+	uint32_t text:21;          /* code point, 0 for an empty cell */
+	uint32_t wide:1;           /* leading half of a double width character */
+	uint32_t attr:10;          /* curses attributes shifted by CELL_ATTR_SHIFT */
+	uint16_t fg, bg;           /* packed colors */
 } Cell;
 
+typedef struct {
+	int fg, bg;                /* colors the pair was initialized with */
+	short prev, next;          /* neighbours in the LRU list, 0 terminated */
+	unsigned int refs;         /* visible rows last drawn with the pair */
+	bool reserved;             /* handed out by vt_color_reserve, never evicted */
+} ColorPair;
+
+typedef struct {
+	uint16_t fg, bg;           /* colors as stored in a cell */
+	short pair;                /* color pair they map to */
+	unsigned int generation;   /* valid while equal to color_generation */
+} ColorCacheEntry;
+
+static ColorPair *color_pairs;   /* indexed by pair number, NULL without color support */
+static short *color_map;         /* hash table of pair numbers keyed by colors, 0 is empty */
+static unsigned int color_map_mask;
+static short color_lru_head, color_lru_tail; /* most and least recently used unreferenced pair */
+static bool color_pairs_exhausted; /* a pair was requested while all of them were referenced */
+static Vt *vts;                  /* all terminals */
+static int *rgb_colors;          /* 24-bit colors referenced by cells */
+static uint16_t *rgb_map;        /* hash table of rgb_colors indices + 1, 0 is empty */
+static unsigned int rgb_count, rgb_map_size;
+
+/* History rows are kept in a compact form: their cells up to the last non
+ * blank one as runs sharing attributes and colors, followed by the text of
+ * the cells encoded as UTF-8. Empty cells are stored as a NUL byte and the
+ * leading half of a double width character is preceded by a 0xff byte. */
+typedef struct {
+	uint16_t len;              /* number of cells in the run */
+	uint16_t attr;             /* attributes as stored in a cell */
+	uint16_t fg, bg;           /* packed colors */
+} Run;
+
+typedef struct {
+	int size;                  /* bytes taken by the whole line */
+	int cols;                  /* cells stored, the remaining ones are blank */
+	int runs;                  /* number of runs */
+	Run run[];                 /* followed by the text */
+} Line;
+
+/* The scroll back buffer is split into chunks of consecutive lines. Only the
+ * few chunks accessed most recently are kept as individual lines, all others
+ * are frozen into one block of memory, which is compressed if built with
+ * zlib. Thawing a chunk keeps its block until one of its lines changes, so
+ * a chunk which was only looked at is frozen again without further work.
+ *
+ * If a spill directory is set, frozen chunks are appended to an unlinked
+ * file created there instead of being kept in memory. The file is mapped
+ * to read them back, which is done by offset without any searching. Once
+ * most of the file is taken by chunks which have been thawed and changed
+ * since, the remaining ones are copied to a new file. */
+#define CHUNK_LINES 256
+#define CHUNKS_HOT 4
+#define SPILL_COMPACT (16 * 1024 * 1024)
+
+typedef struct {
+	char *data;                /* the frozen lines in memory, possibly compressed */
+	size_t offset;             /* position of the frozen lines in the spill file */
+	bool spilled;              /* the frozen lines were written to the spill file */
+	size_t size;               /* bytes of the frozen lines */
+	size_t len;                /* bytes of the frozen lines when uncompressed */
+	int cols;                  /* columns the lines are cut back to when thawed, 0 for all */
+	bool frozen;               /* lines are only available from data */
+} Chunk;
+
 typedef struct {
 	Cell *cells;
-	unsigned dirty:1;
+	int dirty_start, dirty_end; /* columns [start, end) changed since the last draw */
+	int used;                   /* cells from this column on are known to be all zero */
+	int size;                   /* number of allocated cells */
+	short *pairs;               /* color pairs the row was last drawn with */
+	int npairs, pairs_size;     /* their number and the capacity of pairs */
 } Row;
 
+/* The cells of all rows of a buffer are carved out of large blocks. Every
+ * block hands out slots of a single size, a row too wide for a regular
+ * block gets a block of its own. Released slots are threaded through their
+ * first cell and a block is given back once none of its slots are in use.
+ * Blocks are aligned to their size, which makes finding the block of a
+ * slot a matter of masking its address. */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct Block Block;
+struct Block {
+	Block *prev, *next; /* neighbours in the list of the arena */
+	Cell *free;         /* released slots */
+	int size;           /* cells per slot */
+	int slots;          /* number of slots in the block */
+	int used;           /* slots currently handed out */
+	int top;            /* slots handed out at least once */
+	Cell cells[];
+};
+
+typedef struct {
+	Block *avail;       /* blocks with unused slots, recently used first */
+	Block *full;        /* blocks without */
+} Arena;
+
 /* Buffer holding the current terminal window content (as an array) as well
  * as the scroll back buffer content (as a circular/ring buffer).
  *
+ * The rows of the terminal window are a window of 'rows' entries into
+ * lines_buf, which has room for twice as many. Scrolling the whole screen
+ * slides this window down instead of moving every row, only once it hits
+ * the end of lines_buf are the rows moved back to its start.
+ *
  * If new content is added to terminal the view port slides down and the
- * previously top most line is moved into the scroll back buffer at postion
+ * previously top most line is moved into the scroll back buffer at position
  * scroll_index. This index will eventually wrap around and thus overwrite
  * the oldest lines.
  *
- * In the scenerio below a scroll up has been performed. That is 'scroll_above'
+ * In the scenario below a scroll up has been performed. That is 'scroll_above'
  * lines still lie above the current view port. Further scrolling up will show
  * them. Similarly 'scroll_below' is the amount of lines below the current
  * viewport.
  *
- * The function buffer_boundary sets the row pointers to the start/end range
- * of the section delimiting the region before/after the viewport. The functions
- * buffer_row_{first,last} return the first/last logical row. And
- * buffer_row_{next,prev} allows to iterate over the logical lines in either
- * direction.
+ * The scroll back buffer holds no rows, their content is packed into a Line
+ * when they leave the screen and unpacked again into the cells of the row
+ * taking their place once they are scrolled back into view. Its slots are
+ * grouped into chunks of CHUNK_LINES, all but the most recently used of
+ * which are frozen, see Chunk. Visible rows know the number of cells they
+ * have allocated, which is adjusted when the buffer is resized.
  *
  *                                     scroll back buffer
  *
- *                      scroll_buf->+----------------+-----+
- *                                  |                |     | ^  \
- *                                  |     before     |     | |  |
- *    current terminal content      |    viewport    |     | |  |
- *                                  |                |     |    |
- *    +----------------+-----+\     |                |     | s   > scroll_above
- *  ^ |                |  i  | \    |                |  i  | c  |
- *  | |                |  n  |  \   |                |  n  | r  |
- *    |                |  v  |   \  |                |  v  | o  |
- *  r |                |  i  |    \ |                |  i  | l  /
- *  o |    viewport    |  s  |     >|<- scroll_index |  s  | l  \
- *  w |                |  i  |    / |                |  i  |    |
- *  s |                |  b  |   /  |     after      |  b  | s   > scroll_below
- *    |                |  l  |  /   |    viewport    |  l  | i  |
- *  v |                |  e  | /    |                |  e  | z  /
- *    +----------------+-----+/     |     unused     |     | e
- *     <-    maxcols      ->        |   scroll back  |     |
- *     <-    cols    ->             |     buffer     |     | |
- *                                  |                |     | |
- *                                  |                |     | v
- *          roll_buf + scroll_size->+----------------+-----+
- *                                   <-    maxcols       ->
- *                                   <-    cols    ->
+ *                      scroll_buf->+----------------+
+ *                                  |    chunk 0     | ^  \
+ *                                  |- - - - - - - - | |  |
+ *    lines, a window into          |     before     | |  |
+ *    lines_buf                     |    viewport    |    |
+ *    +----------------+-----+\     |                | s   > scroll_above
+ *  ^ |                |  i  | \    |- - - - - - - - | c  |
+ *  | |                |  n  |  \   |                | r  |
+ *    |                |  v  |   \  |                | o  |
+ *  r |                |  i  |    \ |                | l  /
+ *  o |    viewport    |  s  |     >|<- scroll_index | l  \
+ *  w |                |  i  |    / |                |    |
+ *  s |                |  b  |   /  |     after      | s   > scroll_below
+ *    |                |  l  |  /   |    viewport    | i  |
+ *  v |                |  e  | /    |- - - - - - - - | z  /
+ *    +----------------+-----+/     |     unused     | e
+ *     <-   row size      ->        |   scroll back  |
+ *     <-    cols    ->             |     buffer     | |
+ *                                  |                | |
+ *                                  |                | v
+ *        scroll_buf + scroll_size->+----------------+
+ *                                   <- Line * ->
  */
 typedef struct {
 	Row *lines;            /* array of Row pointers of size 'rows' */
+	Row *lines_buf;        /* backing store through which lines slides when scrolling */
+	int lines_size;        /* capacity of lines_buf, twice the number of rows */
+	bool dirty;            /* all rows changed, saves marking each one when scrolling */
 	Row *curs_row;         /* row on which the cursor currently resides */
-	Row *scroll_buf;       /* a ring buffer holding the scroll back content */
+	Line **scroll_buf;     /* a ring buffer holding the scroll back content */
+	Chunk *chunks;         /* scroll_buf split into chunks of CHUNK_LINES */
+	int hot[CHUNKS_HOT];   /* thawed chunks + 1, most recently used first, 0 if unused */
+	int spill_fd;          /* file frozen chunks are spilled to, -1 if none */
+	char *spill;           /* read only mapping of the spill file */
+	size_t spill_size;     /* bytes mapped */
+	size_t spill_len;      /* bytes written to the spill file */
+	size_t spill_live;     /* bytes of it still used by frozen chunks */
+	size_t history;        /* bytes of memory taken by the scroll back content */
+	bool shared;           /* history counts towards the global budget */
 	Row *scroll_top;       /* row in lines where scrolling region starts */
 	Row *scroll_bot;       /* row in lines where scrolling region ends */
 	bool *tabs;            /* a boolean flag for each column whether it is a tab */
@@ -157,17 +333,18 @@ typedef struct {
 	int scroll_above;      /* number of lines above current viewport */
 	int scroll_below;      /* number of lines below current viewport */
 	int rows, cols;        /* current dimension of buffer */
-	int maxcols;           /* allocated cells (maximal cols over time) */
+	int maxcols;           /* allocated tab stops (maximal cols over time) */
 	attr_t curattrs, savattrs; /* current and saved attributes for cells */
 	int curs_col;          /* current cursor column (zero based) */
 	int curs_srow, curs_scol; /* saved cursor row/colmn (zero based) */
-	short curfg, curbg;    /* current fore and background colors */
-	short savfg, savbg;    /* saved colors */
+	uint16_t curfg, curbg; /* current fore and background colors, packed */
+	uint16_t savfg, savbg; /* saved colors */
+	Arena arena;           /* storage for the cells of all rows */
 } Buffer;
 
 struct Vt {
 	Buffer buffer_normal;    /* normal screen buffer */
-	Buffer buffer_alternate; /* alternate screen buffer */
+	Buffer buffer_alternate; /* alternate screen buffer, only allocated while in use */
 	Buffer *buffer;          /* currently active buffer (one of the above) */
 	attr_t defattrs;         /* attributes to use for normal/empty cells */
 	short deffg, defbg;      /* colors to use for back normal/empty cells (white/black) */
@@ -176,7 +353,6 @@ struct Vt {
 	/* flags */
 	unsigned seen_input:1;
 	unsigned insert:1;
-	unsigned escaped:1;
 	unsigned curshid:1;
 	unsigned curskeymode:1;
 	unsigned bell:1;
@@ -184,15 +360,31 @@ struct Vt {
 	unsigned mousetrack:1;
 	unsigned graphmode:1;
 	unsigned savgraphmode:1;
+	unsigned damaged:1;
+	unsigned pairs_missing:1; /* colors were drawn without a pair, all of them were in use */
 	bool charsets[2];
 	/* buffers and parsing state */
-	char rbuf[BUFSIZ];
-	char ebuf[BUFSIZ];
-	unsigned int rlen, elen;
+	char *rbuf;              /* read buffer, grown on demand up to the read budget */
+	size_t rsize;            /* allocated size of the read buffer */
+	size_t rlen;             /* bytes of an incomplete UTF-8 sequence (at most 3) */
+	unsigned char state;     /* current state of the escape sequence parser */
+	int params[16];          /* numeric parameters of current CSI sequence */
+	unsigned int nparams;    /* number of parameters (may exceed capacity) */
+	unsigned int colons;     /* bit i is set if parameter i was separated by a colon */
+	char inter[2];           /* intermediate and private marker characters */
+	unsigned int ninter;     /* number of intermediates (may exceed capacity) */
+	char osc[512];           /* string of an OSC sequence, NUL terminated */
+	unsigned int osclen;
 	int srow, scol;          /* last known offset to display start row, start column */
+	size_t history_budget;   /* own limit for the history, 0 to share the global budget */
+	unsigned long viewed;    /* view_clock when last focused or scrolled back */
+	time_t alternate_left;   /* when the alternate screen was left, in seconds */
+	ColorCacheEntry color_cache[64]; /* direct mapped cache of recently drawn color pairs */
+	Vt *next;                /* next terminal in the list of all terminals */
 	char title[256];         /* xterm style window title */
 	vt_title_handler_t title_handler; /* hook which is called when title changes */
 	vt_urgent_handler_t urgent_handler; /* hook which is called upon bell */
+	vt_damage_handler_t damage_handler; /* hook which is called when content changes after a draw */
 	void *data;              /* user supplied data */
 };
 
@@ -254,12 +446,41 @@ static const char *keytable[KEY_MAX+1] = {
 static void puttab(Vt *t, int count);
 static void process_nonprinting(Vt *t, wchar_t wc);
 static void send_curs(Vt *t);
+static void color_pair_touch(short pair);
+static void color_pair_ref(short pair);
+static void color_pair_unref(short pair);
+static short color_get(Vt *t, int fg, int bg);
+static uint16_t color_pack(int color);
+static int color_unpack(uint16_t color);
 
 __attribute__ ((const))
 static attr_t build_attrs(attr_t curattrs)
 {
-	return ((curattrs & ~A_COLOR) | COLOR_PAIR(curattrs & 0xff))
-	    >> NCURSES_ATTR_SHIFT;
+	attr_t attrs = ((curattrs & ~A_COLOR) | COLOR_PAIR(curattrs & 0xff))
+	    >> CELL_ATTR_SHIFT;
+	if (curattrs & A_ITALIC)
+		attrs |= CELL_ITALIC;
+	return attrs;
+}
+
+/* inverse of build_attrs */
+static attr_t cell_attrs(const Cell *cell)
+{
+	attr_t attrs = (attr_t)cell->attr << CELL_ATTR_SHIFT;
+	if (CELL_ITALIC && (cell->attr & CELL_ITALIC))
+		attrs = (attrs & ~((attr_t)CELL_ITALIC << CELL_ATTR_SHIFT)) | A_ITALIC;
+	return attrs;
+}
+
+static void row_dirty(Row *row, int start, int end)
+{
+	if (row->dirty_start >= row->dirty_end) {
+		row->dirty_start = start;
+		row->dirty_end = end;
+	} else {
+		row->dirty_start = MIN(row->dirty_start, start);
+		row->dirty_end = MAX(row->dirty_end, end);
+	}
 }
 
 static void row_set(Row *row, int start, int len, Buffer *t)
@@ -267,15 +488,281 @@ static void row_set(Row *row, int start, int len, Buffer *t)
 	Cell cell = {
 		.text = L'\0',
 		.attr = t ? build_attrs(t->curattrs) : 0,
-		.fg = t ? t->curfg : -1,
-		.bg = t ? t->curbg : -1,
+		.fg = t ? t->curfg : CELL_COLOR_DEFAULT,
+		.bg = t ? t->curbg : CELL_COLOR_DEFAULT,
 	};
 
-	for (int i = start; i < len + start; i++)
-		row->cells[i] = cell;
-	row->dirty = true;
+	if (!cell.attr && cell.fg == CELL_COLOR_DEFAULT && cell.bg == CELL_COLOR_DEFAULT) {
+		/* only the part which was ever written needs to be cleared */
+		int end = MIN(start + len, row->used);
+		if (start < end)
+			memset(row->cells + start, 0, (end - start) * sizeof(Cell));
+		if (start + len >= row->used)
+			row->used = MIN(row->used, start);
+	} else {
+		for (int i = start; i < len + start; i++)
+			row->cells[i] = cell;
+		row->used = MAX(row->used, start + len);
+	}
+	row_dirty(row, start, start + len);
+}
+
+static void block_unlink(Block **list, Block *blk)
+{
+	if (blk->prev)
+		blk->prev->next = blk->next;
+	else
+		*list = blk->next;
+	if (blk->next)
+		blk->next->prev = blk->prev;
+}
+
+static void block_push(Block **list, Block *blk)
+{
+	blk->prev = NULL;
+	blk->next = *list;
+	if (*list)
+		(*list)->prev = blk;
+	*list = blk;
+}
+
+/* returns size blank cells */
+static Cell *arena_alloc(Arena *a, int size)
+{
+	Block *blk;
+	for (blk = a->avail; blk && blk->size != size; blk = blk->next);
+
+	if (!blk) {
+		size_t len = sizeof(Block) + size * sizeof(Cell);
+		if (len < ARENA_BLOCK_SIZE)
+			len = ARENA_BLOCK_SIZE;
+		void *mem;
+		if (posix_memalign(&mem, ARENA_BLOCK_SIZE, len))
+			return NULL;
+		blk = mem;
+		blk->free = NULL;
+		blk->size = size;
+		blk->slots = (len - sizeof(Block)) / (size * sizeof(Cell));
+		blk->used = blk->top = 0;
+		block_push(&a->avail, blk);
+	} else if (blk != a->avail) {
+		block_unlink(&a->avail, blk);
+		block_push(&a->avail, blk);
+	}
+
+	Cell *cells;
+	if (blk->free) {
+		cells = blk->free;
+		memcpy(&blk->free, cells, sizeof(blk->free));
+	} else {
+		cells = blk->cells + blk->top++ * size;
+	}
+	if (++blk->used == blk->slots) {
+		block_unlink(&a->avail, blk);
+		block_push(&a->full, blk);
+	}
+	memset(cells, 0, size * sizeof(Cell));
+	return cells;
+}
+
+static void arena_free(Arena *a, Cell *cells)
+{
+	if (!cells)
+		return;
+	Block *blk = (Block*)((uintptr_t)cells & ~(uintptr_t)(ARENA_BLOCK_SIZE - 1));
+	if (blk->used-- == blk->slots) {
+		block_unlink(&a->full, blk);
+		block_push(&a->avail, blk);
+	}
+	if (!blk->used) {
+		block_unlink(&a->avail, blk);
+		free(blk);
+		return;
+	}
+	memcpy(cells, &blk->free, sizeof(blk->free));
+	blk->free = cells;
+}
+
+static void arena_destroy(Arena *a)
+{
+	for (Block *blk = a->avail, *next; blk; blk = next) {
+		next = blk->next;
+		free(blk);
+	}
+	for (Block *blk = a->full, *next; blk; blk = next) {
+		next = blk->next;
+		free(blk);
+	}
+	a->avail = a->full = NULL;
+}
+
+/* moves the row into a slot of cols cells, additional ones are blank */
+static bool row_realloc(Arena *a, Row *row, int cols)
+{
+	Cell *cells = arena_alloc(a, cols);
+	if (!cells)
+		return false;
+	if (row->cells)
+		memcpy(cells, row->cells, MIN(row->size, cols) * sizeof(Cell));
+	arena_free(a, row->cells);
+	row->cells = cells;
+	row->size = cols;
+	row->used = MIN(row->used, cols);
+	return true;
+}
+
+/* makes sure the row has at least cols cells */
+static bool row_widen(Arena *a, Row *row, int cols)
+{
+	return row->size >= cols || row_realloc(a, row, cols);
+}
+
+/* gives back the cells beyond cols */
+static void row_trim(Arena *a, Row *row, int cols)
+{
+	if (row->size <= cols || cols <= 0)
+		return;
+	if (!row_realloc(a, row, cols))
+		row_set(row, cols, row->size - cols, NULL);
+}
+
+/* drops the references of a row leaving the screen to the pairs it was drawn with */
+static void row_pairs_release(Row *row)
+{
+	for (int i = 0; i < row->npairs; i++)
+		color_pair_unref(row->pairs[i]);
+	free(row->pairs);
+	row->pairs = NULL;
+	row->npairs = row->pairs_size = 0;
+}
+
+static void buffer_pairs_release(Buffer *b)
+{
+	for (int i = 0; i < b->rows; i++)
+		row_pairs_release(b->lines + i);
+}
+
+static char *utf8_put(char *s, uint32_t c)
+{
+	if (c < 0x80) {
+		*s++ = c;
+	} else if (c < 0x800) {
+		*s++ = 0xc0 | (c >> 6);
+		*s++ = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		*s++ = 0xe0 | (c >> 12);
+		*s++ = 0x80 | ((c >> 6) & 0x3f);
+		*s++ = 0x80 | (c & 0x3f);
+	} else {
+		*s++ = 0xf0 | (c >> 18);
+		*s++ = 0x80 | ((c >> 12) & 0x3f);
+		*s++ = 0x80 | ((c >> 6) & 0x3f);
+		*s++ = 0x80 | (c & 0x3f);
+	}
+	return s;
+}
+
+static const unsigned char *utf8_get(const unsigned char *s, uint32_t *c)
+{
+	if (*s < 0x80) {
+		*c = *s++;
+	} else if (*s < 0xe0) {
+		*c = (*s++ & 0x1f) << 6;
+		*c |= *s++ & 0x3f;
+	} else if (*s < 0xf0) {
+		*c = (*s++ & 0x0f) << 12;
+		*c |= (*s++ & 0x3f) << 6;
+		*c |= *s++ & 0x3f;
+	} else {
+		*c = (*s++ & 0x07) << 18;
+		*c |= (*s++ & 0x3f) << 12;
+		*c |= (*s++ & 0x3f) << 6;
+		*c |= *s++ & 0x3f;
+	}
+	return s;
+}
+
+/* attributes and colors of the cell as one value */
+static inline uint64_t cell_style(const Cell *c)
+{
+	return (uint64_t)c->attr << 32 | (uint32_t)c->fg << 16 | c->bg;
+}
+
+/* returns the compact form of the row, NULL if it is blank (or there is
+ * no memory to store it, in which case its content is lost) */
+static Line *line_pack(const Row *row)
+{
+	static const Cell blank;
+	int cols = MIN(row->used, row->size);
+	while (cols > 0 && !memcmp(row->cells + cols - 1, &blank, sizeof(Cell)))
+		cols--;
+	if (!cols)
+		return NULL;
+
+	Run runs[cols], *run = runs;
+	char text[cols * 5], *s = text;
+	int start = 0;
+	uint64_t style = cell_style(row->cells);
+	*run = (Run){ .attr = row->cells->attr, .fg = row->cells->fg, .bg = row->cells->bg };
+	for (int col = 0; col < cols; col++) {
+		const Cell *c = row->cells + col;
+		if (cell_style(c) != style || col - start == UINT16_MAX) {
+			run->len = col - start;
+			*++run = (Run){ .attr = c->attr, .fg = c->fg, .bg = c->bg };
+			style = cell_style(c);
+			start = col;
+		}
+		if (c->wide)
+			*s++ = '\xff';
+		s = utf8_put(s, c->text);
+	}
+	run->len = cols - start;
+
+	int n = run - runs + 1;
+	Line *line = malloc(sizeof(Line) + n * sizeof(Run) + (s - text));
+	if (!line)
+		return NULL;
+	line->size = sizeof(Line) + n * sizeof(Run) + (s - text);
+	line->cols = cols;
+	line->runs = n;
+	memcpy(line->run, runs, n * sizeof(Run));
+	memcpy(line->run + n, text, s - text);
+	return line;
+}
+
+/* replaces the content of the row by the one of the line */
+static void line_unpack(const Line *line, Row *row)
+{
+	int col = 0;
+	if (line) {
+		int cols = MIN(line->cols, row->size);
+		const unsigned char *s = (const unsigned char*)(line->run + line->runs);
+		for (const Run *r = line->run; col < cols; r++) {
+			for (int i = 0; i < r->len && col < cols; i++) {
+				Cell *c = row->cells + col++;
+				uint32_t text;
+				bool wide = *s == 0xff;
+				s = utf8_get(s + wide, &text);
+				*c = (Cell){ .text = text, .wide = wide, .attr = r->attr, .fg = r->fg, .bg = r->bg };
+			}
+		}
+	}
+	if (row->used > col)
+		memset(row->cells + col, 0, (row->used - col) * sizeof(Cell));
+	row->used = col;
+	row_dirty(row, 0, INT_MAX);
+}
+
+static void row_reverse(Row *start, Row *end)
+{
+	while (start < --end) {
+		Row tmp = *start;
+		*start++ = *end;
+		*end = tmp;
+	}
 }
 
+/* rotates the rows in place, the region might be as tall as the terminal */
 static void row_roll(Row *start, Row *end, int count)
 {
 	int n = end - start;
@@ -285,44 +772,352 @@ static void row_roll(Row *start, Row *end, int count)
 		count += n;
 
 	if (count) {
-		char buf[count * sizeof(Row)];
-		memcpy(buf, start, count * sizeof(Row));
-		memmove(start, start + count, (n - count) * sizeof(Row));
-		memcpy(end - count, buf, count * sizeof(Row));
+		row_reverse(start, start + count);
+		row_reverse(start + count, end);
+		row_reverse(start, end);
 		for (Row *row = start; row < end; row++)
-			row->dirty = true;
+			row_dirty(row, 0, INT_MAX);
 	}
 }
 
 static void buffer_clear(Buffer *b)
 {
-	Cell cell = {
-		.text = L'\0',
-		.attr = A_NORMAL,
-		.fg = -1,
-		.bg = -1,
-	};
-
 	for (int i = 0; i < b->rows; i++) {
 		Row *row = b->lines + i;
-		for (int j = 0; j < b->cols; j++) {
-			row->cells[j] = cell;
-			row->dirty = true;
-		}
+		row_set(row, 0, b->cols, NULL);
+		row_dirty(row, 0, INT_MAX);
 	}
 }
 
 static void buffer_free(Buffer *b)
 {
-	for (int i = 0; i < b->rows; i++)
-		free(b->lines[i].cells);
-	free(b->lines);
 	for (int i = 0; i < b->scroll_size; i++)
-		free(b->scroll_buf[i].cells);
+		free(b->scroll_buf[i]);
+	for (int i = 0; i < (b->scroll_size + CHUNK_LINES - 1) / CHUNK_LINES; i++)
+		free(b->chunks[i].data);
+	free(b->chunks);
+	buffer_pairs_release(b);
+	if (b->shared)
+		history_total -= b->history;
+	if (b->spill)
+		munmap(b->spill, b->spill_size);
+	if (b->spill_fd != -1)
+		close(b->spill_fd);
+	arena_destroy(&b->arena);
+	free(b->lines_buf);
 	free(b->scroll_buf);
 	free(b->tabs);
 }
 
+/* moves the visible lines back to the start of their backing store */
+static void buffer_compact(Buffer *b)
+{
+	ptrdiff_t d = b->lines - b->lines_buf;
+	if (!d)
+		return;
+	memmove(b->lines_buf, b->lines, b->rows * sizeof(Row));
+	b->lines -= d;
+	b->curs_row -= d;
+	b->scroll_top -= d;
+	b->scroll_bot -= d;
+}
+
+static int chunk_lines(Buffer *b, int c)
+{
+	return MIN(CHUNK_LINES, b->scroll_size - c * CHUNK_LINES);
+}
+
+static void chunk_cut(Buffer *b, int c, int cols)
+{
+	Line **lines = b->scroll_buf + c * CHUNK_LINES;
+	for (int i = 0; i < chunk_lines(b, c); i++) {
+		if (lines[i] && lines[i]->cols > cols)
+			lines[i]->cols = cols;
+	}
+}
+
+static void history_add(Buffer *b, size_t bytes)
+{
+	b->history += bytes;
+	if (b->shared)
+		history_total += bytes;
+}
+
+static void history_sub(Buffer *b, size_t bytes)
+{
+	b->history -= bytes;
+	if (b->shared)
+		history_total -= bytes;
+}
+
+/* forgets about the frozen lines once they no longer match */
+static void chunk_drop(Buffer *b, Chunk *chunk)
+{
+	if (chunk->data)
+		history_sub(b, chunk->size);
+	free(chunk->data);
+	chunk->data = NULL;
+	if (chunk->spilled)
+		b->spill_live -= chunk->size;
+	chunk->spilled = false;
+}
+
+static int spill_open(void)
+{
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/dvtm-scroll-XXXXXX", spill_dir) >= (int)sizeof(path))
+		return -1;
+	int fd = mkstemp(path);
+	if (fd == -1)
+		return -1;
+	unlink(path);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+/* makes sure the first len bytes of the spill file are mapped */
+static bool buffer_spill_map(Buffer *b, size_t len)
+{
+	if (len <= b->spill_size)
+		return true;
+	size_t size = MAX(MAX(len, 2 * b->spill_size), (size_t)SPILL_COMPACT);
+	char *spill = mmap(NULL, size, PROT_READ, MAP_SHARED, b->spill_fd, 0);
+	if (spill == MAP_FAILED)
+		return false;
+	if (b->spill)
+		munmap(b->spill, b->spill_size);
+	b->spill = spill;
+	b->spill_size = size;
+	return true;
+}
+
+/* copies the spilled chunks to a new file, leaving out the unused parts.
+ * The old file stays in use unless the new one could be written and mapped. */
+static void buffer_spill_compact(Buffer *b)
+{
+	int nchunks = (b->scroll_size + CHUNK_LINES - 1) / CHUNK_LINES;
+	int fd = spill_open();
+	if (fd == -1)
+		return;
+
+	size_t len = 0;
+	for (int c = 0; c < nchunks; c++) {
+		Chunk *chunk = b->chunks + c;
+		if (!chunk->spilled)
+			continue;
+		if (pwrite(fd, b->spill + chunk->offset, chunk->size, len) != (ssize_t)chunk->size) {
+			close(fd);
+			return;
+		}
+		len += chunk->size;
+	}
+
+	size_t size = MAX(len, (size_t)SPILL_COMPACT);
+	char *spill = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (spill == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+
+	len = 0;
+	for (int c = 0; c < nchunks; c++) {
+		Chunk *chunk = b->chunks + c;
+		if (!chunk->spilled)
+			continue;
+		chunk->offset = len;
+		len += chunk->size;
+	}
+	munmap(b->spill, b->spill_size);
+	close(b->spill_fd);
+	b->spill = spill;
+	b->spill_size = size;
+	b->spill_fd = fd;
+	b->spill_len = b->spill_live = len;
+}
+
+/* moves the frozen lines of the chunk from memory to the spill file */
+static void buffer_spill(Buffer *b, Chunk *chunk)
+{
+	if (!spill_dir)
+		return;
+	if (b->spill_fd == -1 && (b->spill_fd = spill_open()) == -1)
+		return;
+	if (b->spill_len > SPILL_COMPACT && b->spill_len > 2 * b->spill_live)
+		buffer_spill_compact(b);
+
+	size_t offset = b->spill_len;
+	if (!buffer_spill_map(b, offset + chunk->size) ||
+	    pwrite(b->spill_fd, chunk->data, chunk->size, offset) != (ssize_t)chunk->size)
+		return;
+	free(chunk->data);
+	chunk->data = NULL;
+	chunk->offset = offset;
+	chunk->spilled = true;
+	b->spill_len += chunk->size;
+	b->spill_live += chunk->size;
+}
+
+static void chunk_freeze(Buffer *b, int c)
+{
+	Chunk *chunk = b->chunks + c;
+	Line **lines = b->scroll_buf + c * CHUNK_LINES;
+	int n = chunk_lines(b, c);
+
+	if (!chunk->data && !chunk->spilled) {
+		size_t len = 0;
+		for (int i = 0; i < n; i++)
+			len += sizeof(int) + (lines[i] ? lines[i]->size : 0);
+		if (len == n * sizeof(int))
+			return; /* all lines are blank, there is nothing to keep */
+		char *data = malloc(len), *s = data;
+		if (!data)
+			return;
+		for (int i = 0; i < n; i++) {
+			int size = lines[i] ? lines[i]->size : 0;
+			memcpy(s, &size, sizeof(size));
+			if (size)
+				memcpy(s + sizeof(size), lines[i], size);
+			s += sizeof(size) + size;
+		}
+		chunk->data = data;
+		chunk->size = chunk->len = len;
+#ifdef HAVE_ZLIB
+		uLongf size = compressBound(len);
+		char *z = malloc(size);
+		if (z && compress2((Bytef*)z, &size, (Bytef*)data, len, 1) == Z_OK && size < len) {
+			free(data);
+			chunk->data = realloc(z, size);
+			if (!chunk->data)
+				chunk->data = z;
+			chunk->size = size;
+		} else {
+			free(z);
+		}
+#endif
+		buffer_spill(b, chunk);
+		if (chunk->data)
+			history_add(b, chunk->size);
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (lines[i])
+			history_sub(b, lines[i]->size);
+		free(lines[i]);
+		lines[i] = NULL;
+	}
+	chunk->frozen = true;
+}
+
+/* makes the lines of a frozen chunk available again, they are lost if
+ * there is not enough memory to do so */
+static void chunk_thaw(Buffer *b, int c)
+{
+	Chunk *chunk = b->chunks + c;
+	Line **lines = b->scroll_buf + c * CHUNK_LINES;
+	int n = chunk_lines(b, c);
+	if (!chunk->frozen)
+		return;
+	chunk->frozen = false;
+
+	char *frozen = chunk->spilled ? b->spill + chunk->offset : chunk->data;
+	char *data = frozen;
+#ifdef HAVE_ZLIB
+	if (chunk->size < chunk->len) {
+		uLongf len = chunk->len;
+		data = malloc(len);
+		if (data && uncompress((Bytef*)data, &len, (Bytef*)frozen, chunk->size) != Z_OK) {
+			free(data);
+			data = NULL;
+		}
+	}
+#endif
+	const char *s = data;
+	for (int i = 0; s && i < n; i++) {
+		int size;
+		memcpy(&size, s, sizeof(size));
+		s += sizeof(size);
+		if (size && (lines[i] = malloc(size))) {
+			memcpy(lines[i], s, size);
+			history_add(b, size);
+		}
+		s += size;
+	}
+	if (data != frozen)
+		free(data);
+	if (chunk->spilled) {
+		/* the file still holds them, they need not stay resident */
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t)frozen & ~(page - 1);
+		posix_madvise((void*)start, (uintptr_t)frozen + chunk->size - start, POSIX_MADV_DONTNEED);
+	}
+
+	if (!data || chunk->cols) {
+		if (chunk->cols)
+			chunk_cut(b, c, chunk->cols);
+		chunk->cols = 0;
+		chunk_drop(b, chunk);
+	}
+}
+
+/* thaws the chunk, freezing the one used least recently instead */
+static void buffer_chunk_use(Buffer *b, int c)
+{
+	int i;
+	if (b->hot[0] == c + 1)
+		return;
+	chunk_thaw(b, c);
+	for (i = 0; i < CHUNKS_HOT - 1 && b->hot[i] != c + 1; i++);
+	if (b->hot[i] != c + 1 && b->hot[i])
+		chunk_freeze(b, b->hot[i] - 1);
+	memmove(b->hot + 1, b->hot, i * sizeof(*b->hot));
+	b->hot[0] = c + 1;
+}
+
+/* packs the row into the history slot at scroll_index, the line stored
+ * there so far is unpacked into the cells of the row if load is set */
+static void buffer_history_exchange(Buffer *b, Row *row, bool load)
+{
+	Chunk *chunk = b->chunks + b->scroll_index / CHUNK_LINES;
+	buffer_chunk_use(b, b->scroll_index / CHUNK_LINES);
+	chunk_drop(b, chunk);
+
+	Line *line = b->scroll_buf[b->scroll_index];
+	Line *packed = line_pack(row);
+	if (line)
+		history_sub(b, line->size);
+	if (packed)
+		history_add(b, packed->size);
+	b->scroll_buf[b->scroll_index] = packed;
+	if (load)
+		line_unpack(line, row);
+	free(line);
+}
+
+/* drops the oldest lines of the scroll back buffer up to the end of the
+ * chunk holding them, returns false if there were none */
+static bool buffer_history_trim(Buffer *b)
+{
+	if (!b->scroll_above)
+		return false;
+	int start = (b->scroll_index - b->scroll_above + b->scroll_size) % b->scroll_size;
+	int c = start / CHUNK_LINES;
+	int n = MIN(b->scroll_above, c * CHUNK_LINES + chunk_lines(b, c) - start);
+	Chunk *chunk = b->chunks + c;
+	if (chunk->frozen && n < chunk_lines(b, c))
+		buffer_chunk_use(b, c);
+	chunk->frozen = false;
+	chunk->cols = 0;
+	chunk_drop(b, chunk);
+	for (int i = start; i < start + n; i++) {
+		if (b->scroll_buf[i])
+			history_sub(b, b->scroll_buf[i]->size);
+		free(b->scroll_buf[i]);
+		b->scroll_buf[i] = NULL;
+	}
+	b->scroll_above -= n;
+	return true;
+}
+
 static void buffer_scroll(Buffer *b, int s)
 {
 	/* work in screenfuls */
@@ -342,14 +1137,34 @@ static void buffer_scroll(Buffer *b, int s)
 	if (b->scroll_above >= b->scroll_size)
 		b->scroll_above = b->scroll_size;
 
-	if (s > 0 && b->scroll_size) {
+	if (s > 0 && b->scroll_top == b->lines && b->scroll_bot == b->lines + b->rows) {
+		/* the whole screen scrolls, instead of moving all rows the window
+		 * of visible lines slides down and the rows leaving it at the top,
+		 * or the history rows they are exchanged with, enter at the bottom */
+		if (b->lines + b->rows + s > b->lines_buf + b->lines_size)
+			buffer_compact(b);
 		for (int i = 0; i < s; i++) {
-			Row tmp = b->scroll_top[i];
-			b->scroll_top[i] = b->scroll_buf[b->scroll_index];
-			b->scroll_buf[b->scroll_index] = tmp;
+			Row row = b->lines[i];
+			if (b->scroll_size) {
+				/* lines below the viewport come back, the oldest are dropped */
+				buffer_history_exchange(b, &row, b->scroll_below);
+				if (++b->scroll_index == b->scroll_size)
+					b->scroll_index = 0;
+			}
+			b->lines[b->rows + i] = row;
+		}
+		b->lines += s;
+		b->curs_row += s;
+		b->scroll_top += s;
+		b->scroll_bot += s;
+		b->dirty = true;
+		return;
+	}
 
-			b->scroll_index++;
-			if (b->scroll_index == b->scroll_size)
+	if (s > 0 && b->scroll_size) {
+		for (int i = 0; i < s; i++) {
+			buffer_history_exchange(b, b->scroll_top + i, b->scroll_below);
+			if (++b->scroll_index == b->scroll_size)
 				b->scroll_index = 0;
 		}
 	}
@@ -360,62 +1175,92 @@ static void buffer_scroll(Buffer *b, int s)
 			if (b->scroll_index == -1)
 				b->scroll_index = b->scroll_size - 1;
 
-			Row tmp = b->scroll_top[i];
-			b->scroll_top[i] = b->scroll_buf[b->scroll_index];
-			b->scroll_buf[b->scroll_index] = tmp;
-			b->scroll_top[i].dirty = true;
+			buffer_history_exchange(b, b->scroll_top + i, true);
 		}
 	}
 }
 
 static void buffer_resize(Buffer *b, int rows, int cols)
 {
+	buffer_compact(b);
 	Row *lines = b->lines;
 
 	if (b->rows != rows) {
 		if (b->curs_row >= lines + rows) {
 			/* scroll up instead of simply chopping off bottom */
 			buffer_scroll(b, (b->curs_row - b->lines) - rows + 1);
+			buffer_compact(b);
+			lines = b->lines;
 		}
 		while (b->rows > rows) {
-			free(lines[b->rows - 1].cells);
+			row_pairs_release(lines + b->rows - 1);
+			arena_free(&b->arena, lines[b->rows - 1].cells);
 			b->rows--;
 		}
 
-		lines = realloc(lines, sizeof(Row) * rows);
+		Row *l = realloc(lines, sizeof(Row) * 2 * rows);
+		if (l)
+			lines = l;
+		else if (rows > b->rows)
+			rows = b->rows;
 	}
 
-	if (b->maxcols < cols) {
+	/* Every row has at least cols cells. If there is not enough memory
+	 * to widen all of them the buffer keeps its width, and it does not
+	 * grow by rows which could not be allocated. */
+	if (b->cols < cols) {
 		for (int row = 0; row < b->rows; row++) {
-			lines[row].cells = realloc(lines[row].cells, sizeof(Cell) * cols);
-			if (b->cols < cols)
-				row_set(lines + row, b->cols, cols - b->cols, NULL);
-			lines[row].dirty = true;
+			if (!row_widen(&b->arena, lines + row, cols)) {
+				cols = b->cols;
+				break;
+			}
 		}
-		Row *sbuf = b->scroll_buf;
-		for (int row = 0; row < b->scroll_size; row++) {
-			sbuf[row].cells = realloc(sbuf[row].cells, sizeof(Cell) * cols);
-			if (b->cols < cols)
-				row_set(sbuf + row, b->cols, cols - b->cols, NULL);
+	} else if (b->cols > cols) {
+		/* give back the cells cut off by the shrink, history lines
+		 * merely forget about them */
+		for (int row = 0; row < b->rows; row++)
+			row_trim(&b->arena, lines + row, cols);
+		for (int c = 0; c < (b->scroll_size + CHUNK_LINES - 1) / CHUNK_LINES; c++) {
+			Chunk *chunk = b->chunks + c;
+			if (chunk->frozen) {
+				if (!chunk->cols || chunk->cols > cols)
+					chunk->cols = cols;
+			} else {
+				chunk_cut(b, c, cols);
+				chunk_drop(b, chunk);
+			}
 		}
+	}
+	if (b->maxcols < cols) {
 		b->tabs = realloc(b->tabs, sizeof(*b->tabs) * cols);
 		for (int col = b->cols; col < cols; col++)
 			b->tabs[col] = !(col & 7);
 		b->maxcols = cols;
-		b->cols = cols;
-	} else if (b->cols != cols) {
+	}
+	if (b->cols != cols) {
 		for (int row = 0; row < b->rows; row++)
-			lines[row].dirty = true;
+			row_dirty(lines + row, 0, INT_MAX);
 		b->cols = cols;
 	}
 
 	int deltarows = 0;
 	if (b->rows < rows) {
 		while (b->rows < rows) {
-			lines[b->rows].cells = calloc(b->maxcols, sizeof(Cell));
-			row_set(lines + b->rows, 0, b->maxcols, b);
-			b->rows++;
+			Cell *cells = arena_alloc(&b->arena, cols);
+			if (!cells)
+				break;
+			Row *row = lines + b->rows++;
+			row->cells = cells;
+			row->dirty_start = row->dirty_end = row->used = 0;
+			row->pairs = NULL;
+			row->npairs = row->pairs_size = 0;
+			row->size = cols;
+			if (build_attrs(b->curattrs) || b->curfg != CELL_COLOR_DEFAULT || b->curbg != CELL_COLOR_DEFAULT)
+				row_set(row, 0, row->size, b);
+			else
+				row_dirty(row, 0, INT_MAX);
 		}
+		rows = b->rows;
 
 		/* prepare for backfill */
 		if (b->curs_row >= b->scroll_bot - 1) {
@@ -428,114 +1273,64 @@ static void buffer_resize(Buffer *b, int rows, int cols)
 	b->curs_row += lines - b->lines;
 	b->scroll_top = lines;
 	b->scroll_bot = lines + rows;
-	b->lines = lines;
+	b->lines = b->lines_buf = lines;
+	b->lines_size = 2 * rows;
 
 	/* perform backfill */
 	if (deltarows > 0) {
 		buffer_scroll(b, -deltarows);
 		b->curs_row += deltarows;
 	}
+
+	/* only the cursor of the active buffer is clamped by the caller */
+	if (b->curs_row >= b->lines + b->rows)
+		b->curs_row = b->lines + b->rows - 1;
 }
 
 static bool buffer_init(Buffer *b, int rows, int cols, int scroll_size)
 {
 	b->curattrs = A_NORMAL;	/* white text over black background */
-	b->curfg = b->curbg = -1;
+	b->curfg = b->curbg = CELL_COLOR_DEFAULT;
+	b->spill_fd = -1;
 	if (scroll_size < 0)
 		scroll_size = 0;
-	if (scroll_size && !(b->scroll_buf = calloc(scroll_size, sizeof(Row))))
+	if (scroll_size && !(b->scroll_buf = calloc(scroll_size, sizeof(Line*))))
+		return false;
+	if (scroll_size && !(b->chunks = calloc((scroll_size + CHUNK_LINES - 1) / CHUNK_LINES, sizeof(Chunk))))
 		return false;
 	b->scroll_size = scroll_size;
 	buffer_resize(b, rows, cols);
-	return true;
-}
-
-static void buffer_boundry(Buffer *b, Row **bs, Row **be, Row **as, Row **ae) {
-	if (bs)
-		*bs = NULL;
-	if (be)
-		*be = NULL;
-	if (as)
-		*as = NULL;
-	if (ae)
-		*ae = NULL;
-	if (!b->scroll_size)
-		return;
-
-	if (b->scroll_above) {
-		if (bs)
-			*bs = &b->scroll_buf[(b->scroll_index - b->scroll_above + b->scroll_size) % b->scroll_size];
-		if (be)
-			*be = &b->scroll_buf[(b->scroll_index-1 + b->scroll_size) % b->scroll_size];
-	}
-	if (b->scroll_below) {
-		if (as)
-			*as = &b->scroll_buf[b->scroll_index];
-		if (ae)
-			*ae = &b->scroll_buf[(b->scroll_index + b->scroll_below-1) % b->scroll_size];
-	}
+	return b->rows == rows && b->cols == cols;
 }
 
-static Row *buffer_row_first(Buffer *b) {
-	Row *bstart;
-	if (!b->scroll_size || !b->scroll_above)
-		return b->lines;
-	buffer_boundry(b, &bstart, NULL, NULL, NULL);
-	return bstart;
-}
-
-static Row *buffer_row_last(Buffer *b) {
-	Row *aend;
-	if (!b->scroll_size || !b->scroll_below)
-		return b->lines + b->rows - 1;
-	buffer_boundry(b, NULL, NULL, NULL, &aend);
-	return aend;
+static time_t monotonic_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
 }
 
-static Row *buffer_row_next(Buffer *b, Row *row)
+/* Most terminals never switch to the alternate screen, its buffer is set up
+ * when it is first entered. After it was left the buffer is kept for a while
+ * in case it is entered again before vt_idle releases it. On resize it is
+ * released right away instead of following the size of the terminal. */
+static bool alternate_alloc(Vt *t)
 {
-	Row *before_start, *before_end, *after_start, *after_end;
-	Row *first = b->lines, *last = b->lines + b->rows - 1;
-
-	if (!row)
-		return NULL;
-
-	buffer_boundry(b, &before_start, &before_end, &after_start, &after_end);
-
-	if (row >= first && row < last)
-		return ++row;
-	if (row == last)
-		return after_start;
-	if (row == before_end)
-		return first;
-	if (row == after_end)
-		return NULL;
-	if (row == &b->scroll_buf[b->scroll_size - 1])
-		return b->scroll_buf;
-	return ++row;
+	Buffer *b = &t->buffer_alternate;
+	if (!b->lines_buf && !buffer_init(b, t->buffer_normal.rows, t->buffer_normal.cols, 0)) {
+		buffer_free(b);
+		memset(b, 0, sizeof(*b));
+	}
+	return b->lines_buf;
 }
 
-static Row *buffer_row_prev(Buffer *b, Row *row)
+static void alternate_release(Vt *t)
 {
-	Row *before_start, *before_end, *after_start, *after_end;
-	Row *first = b->lines, *last = b->lines + b->rows - 1;
-
-	if (!row)
-		return NULL;
-
-	buffer_boundry(b, &before_start, &before_end, &after_start, &after_end);
-
-	if (row > first && row <= last)
-		return --row;
-	if (row == first)
-		return before_end;
-	if (row == before_start)
-		return NULL;
-	if (row == after_start)
-		return last;
-	if (row == b->scroll_buf)
-		return &b->scroll_buf[b->scroll_size - 1];
-	return --row;
+	Buffer *b = &t->buffer_alternate;
+	if (!b->lines_buf || t->buffer == b)
+		return;
+	buffer_free(b);
+	memset(b, 0, sizeof(*b));
 }
 
 static void cursor_clamp(Vt *t)
@@ -557,7 +1352,7 @@ static void cursor_clamp(Vt *t)
 static void cursor_line_down(Vt *t)
 {
 	Buffer *b = t->buffer;
-	row_set(b->curs_row, b->cols, b->maxcols - b->cols, NULL);
+	row_trim(&b->arena, b->curs_row, b->cols);
 	b->curs_row++;
 	if (b->curs_row < b->scroll_bot)
 		return;
@@ -602,25 +1397,45 @@ static void attributes_restore(Vt *t)
 	t->graphmode = t->savgraphmode;
 }
 
-static void new_escape_sequence(Vt *t)
+/* parses the color of an extended SGR 38 or 48 parameter at param[*i] in
+ * its 5;n and 2;r;g;b forms, either separated by semicolons or as colon
+ * separated sub parameters which may include a color space identifier.
+ * The parameters of the color are consumed even if they are invalid. */
+static bool interpret_csi_sgr_color(Vt *t, int param[], int pcount, int *i, uint16_t *color)
 {
-	t->escaped = true;
-	t->elen = 0;
-	t->ebuf[0] = '\0';
-}
+	int j = *i + 1, n = pcount - j - 1;
+	bool colons = j < pcount && (t->colons & (1u << j));
 
-static void cancel_escape_sequence(Vt *t)
-{
-	t->escaped = false;
-	t->elen = 0;
-	t->ebuf[0] = '\0';
-}
+	if (j >= pcount)
+		return false;
+	if (colons) {
+		for (n = 0; j + n + 1 < pcount && (t->colons & (1u << (j + n + 1))); n++);
+		*i = j + n;
+	}
 
-static bool is_valid_csi_ender(int c)
-{
-	return (c >= 'a' && c <= 'z')
-	    || (c >= 'A' && c <= 'Z')
-	    || (c == '@' || c == '`');
+	switch (param[j]) {
+	case 5:
+		if (!colons)
+			*i = j + MIN(n, 1);
+		if (n < 1 || param[j + 1] > 255)
+			return false;
+		*color = color_pack(param[j + 1]);
+		return true;
+	case 2:
+		if (!colons)
+			*i = j + MIN(n, 3);
+		if (colons && n > 3) {
+			j++;
+			n--;
+		}
+		if (n < 3)
+			return false;
+		*color = color_pack(RGB_COLOR | MIN(param[j + 1], 255) << 16 |
+		                    MIN(param[j + 2], 255) << 8 | MIN(param[j + 3], 255));
+		return true;
+	}
+
+	return false;
 }
 
 /* interprets a 'set attribute' (SGR) CSI escape sequence */
@@ -630,7 +1445,7 @@ static void interpret_csi_sgr(Vt *t, int param[], int pcount)
 	if (pcount == 0) {
 		/* special case: reset attributes */
 		b->curattrs = A_NORMAL;
-		b->curfg = b->curbg = -1;
+		b->curfg = b->curbg = CELL_COLOR_DEFAULT;
 		return;
 	}
 
@@ -638,7 +1453,7 @@ static void interpret_csi_sgr(Vt *t, int param[], int pcount)
 		switch (param[i]) {
 		case 0:
 			b->curattrs = A_NORMAL;
-			b->curfg = b->curbg = -1;
+			b->curfg = b->curbg = CELL_COLOR_DEFAULT;
 			break;
 		case 1:
 			b->curattrs |= A_BOLD;
@@ -646,13 +1461,15 @@ static void interpret_csi_sgr(Vt *t, int param[], int pcount)
 		case 2:
 			b->curattrs |= A_DIM;
 			break;
-#ifdef A_ITALIC
 		case 3:
 			b->curattrs |= A_ITALIC;
 			break;
-#endif
 		case 4:
-			b->curattrs |= A_UNDERLINE;
+			/* 4:0 turns it off, any other style is a plain underline */
+			if (i + 1 < pcount && (t->colons & (1u << (i + 1))) && !param[i + 1])
+				b->curattrs &= ~A_UNDERLINE;
+			else
+				b->curattrs |= A_UNDERLINE;
 			break;
 		case 5:
 			b->curattrs |= A_BLINK;
@@ -666,11 +1483,9 @@ static void interpret_csi_sgr(Vt *t, int param[], int pcount)
 		case 22:
 			b->curattrs &= ~(A_BOLD | A_DIM);
 			break;
-#ifdef A_ITALIC
 		case 23:
 			b->curattrs &= ~A_ITALIC;
 			break;
-#endif
 		case 24:
 			b->curattrs &= ~A_UNDERLINE;
 			break;
@@ -684,38 +1499,35 @@ static void interpret_csi_sgr(Vt *t, int param[], int pcount)
 			b->curattrs &= ~A_INVIS;
 			break;
 		case 30 ... 37:	/* fg */
-			b->curfg = param[i] - 30;
+			b->curfg = color_pack(param[i] - 30);
 			break;
 		case 38:
-			if ((i + 2) < pcount && param[i + 1] == 5) {
-				b->curfg = param[i + 2];
-				i += 2;
-			}
+			interpret_csi_sgr_color(t, param, pcount, &i, &b->curfg);
 			break;
 		case 39:
-			b->curfg = -1;
+			b->curfg = CELL_COLOR_DEFAULT;
 			break;
 		case 40 ... 47:	/* bg */
-			b->curbg = param[i] - 40;
+			b->curbg = color_pack(param[i] - 40);
 			break;
 		case 48:
-			if ((i + 2) < pcount && param[i + 1] == 5) {
-				b->curbg = param[i + 2];
-				i += 2;
-			}
+			interpret_csi_sgr_color(t, param, pcount, &i, &b->curbg);
 			break;
 		case 49:
-			b->curbg = -1;
+			b->curbg = CELL_COLOR_DEFAULT;
 			break;
 		case 90 ... 97:	/* hi fg */
-			b->curfg = param[i] - 82;
+			b->curfg = color_pack(param[i] - 82);
 			break;
 		case 100 ... 107: /* hi bg */
-			b->curbg = param[i] - 92;
+			b->curbg = color_pack(param[i] - 92);
 			break;
 		default:
 			break;
 		}
+		/* colon separated sub parameters belong to the one just handled */
+		while (i + 1 < pcount && (t->colons & (1u << (i + 1))))
+			i++;
 	}
 }
 
@@ -727,7 +1539,7 @@ static void interpret_csi_ed(Vt *t, int param[], int pcount)
 
 	attributes_save(t);
 	b->curattrs = A_NORMAL;
-	b->curfg = b->curbg = -1;
+	b->curfg = b->curbg = CELL_COLOR_DEFAULT;
 
 	if (pcount && param[0] == 2) {
 		start = b->lines;
@@ -839,6 +1651,8 @@ static void interpret_csi_ich(Vt *t, int param[], int pcount)
 
 	for (int i = b->cols - 1; i >= b->curs_col + n; i--)
 		row->cells[i] = row->cells[i - n];
+	row_dirty(row, b->curs_col, b->cols);
+	row->used = MAX(row->used, b->cols);
 
 	row_set(row, b->curs_col, n, b);
 }
@@ -855,6 +1669,7 @@ static void interpret_csi_dch(Vt *t, int param[], int pcount)
 
 	for (int i = b->curs_col; i < b->cols - n; i++)
 		row->cells[i] = row->cells[i + n];
+	row_dirty(row, b->curs_col, b->cols);
 
 	row_set(row, b->cols - n, n, b);
 }
@@ -968,8 +1783,15 @@ static void interpret_csi_priv_mode(Vt *t, int param[], int pcount, bool set)
 		case 1049: /* combine 1047 + 1048 */
 		case 47:   /* use alternate/normal screen buffer */
 		case 1047:
-			if (!set)
+			if (set && !alternate_alloc(t))
+				break;
+			if (!set && t->buffer == &t->buffer_alternate) {
 				buffer_clear(&t->buffer_alternate);
+				t->alternate_left = monotonic_seconds();
+			}
+			/* the buffer no longer shown keeps no pairs from eviction */
+			if (t->buffer != (set ? &t->buffer_alternate : &t->buffer_normal))
+				buffer_pairs_release(t->buffer);
 			t->buffer = set ? &t->buffer_alternate : &t->buffer_normal;
 			vt_dirty(t);
 			if (param[i] != 1049)
@@ -988,31 +1810,13 @@ static void interpret_csi_priv_mode(Vt *t, int param[], int pcount, bool set)
 	}
 }
 
-static void interpret_csi(Vt *t)
+static void interpret_csi(Vt *t, wchar_t verb)
 {
 	Buffer *b = t->buffer;
-	int csiparam[16];
-	unsigned int param_count = 0;
-	const char *p = t->ebuf + 1;
-	char verb = t->ebuf[t->elen - 1];
-
-	/* parse numeric parameters */
-	for (p += (t->ebuf[1] == '?'); *p; p++) {
-		if (IS_CONTROL(*p)) {
-			process_nonprinting(t, *p);
-		} else if (*p == ';') {
-			if (param_count >= LENGTH(csiparam))
-				return;	/* too long! */
-			csiparam[param_count++] = 0;
-		} else if (isdigit((unsigned char)*p)) {
-			if (param_count == 0)
-				csiparam[param_count++] = 0;
-			csiparam[param_count - 1] *= 10;
-			csiparam[param_count - 1] += *p - '0';
-		}
-	}
+	int *csiparam = t->params;
+	unsigned int param_count = MIN(t->nparams, LENGTH(t->params));
 
-	if (t->ebuf[1] == '?') {
+	if (t->ninter == 1 && t->inter[0] == '?') {
 		switch (verb) {
 		case 'h':
 		case 'l': /* private set/reset mode */
@@ -1022,6 +1826,10 @@ static void interpret_csi(Vt *t)
 		return;
 	}
 
+	/* other private markers or intermediate characters are not supported */
+	if (t->ninter)
+		return;
+
 	/* delegate handling depending on command character (verb) */
 	switch (verb) {
 	case 'h':
@@ -1137,10 +1945,10 @@ static void interpret_csi_nel(Vt *t)
 }
 
 /* Interpret a 'select character set' (SCS) sequence */
-static void interpret_csi_scs(Vt *t)
+static void interpret_csi_scs(Vt *t, char inter, wchar_t final)
 {
 	/* ESC ( sets G0, ESC ) sets G1 */
-	t->charsets[!!(t->ebuf[0] == ')')] = (t->ebuf[1] == '0');
+	t->charsets[inter == ')'] = (final == '0');
 	t->graphmode = t->charsets[0];
 }
 
@@ -1149,10 +1957,10 @@ static void interpret_osc(Vt *t)
 {
 	/* ESC ] command ; data BEL
 	 * ESC ] command ; data ESC \\
-	 * Note that BEL or ESC \\ have already been replaced with NUL.
+	 * Note that only the string between ] and the terminator is stored.
 	 */
 	char *data = NULL;
-	int command = strtoul(t->ebuf + 1, &data, 10);
+	int command = strtoul(t->osc, &data, 10);
 	if (data && *data == ';') {
 		switch (command) {
 		case 0: /* icon name and window title */
@@ -1171,84 +1979,54 @@ static void interpret_osc(Vt *t)
 	}
 }
 
-static void try_interpret_escape_seq(Vt *t)
+/* Interpret an escape sequence which is neither CSI, OSC nor DCS */
+static void interpret_esc(Vt *t, wchar_t final)
 {
-	char lastchar = t->ebuf[t->elen - 1];
+	if (t->ninter == 1) {
+		switch (t->inter[0]) {
+		case '#': /* ignore DECDHL, DECSWL, DECDWL, DECHCP, DECFPP */
+			if (final == '8') /* DECALN */
+				interpret_csi_ed(t, (int []){ 2 }, 1);
+			break;
+		case '(':
+		case ')':
+			interpret_csi_scs(t, t->inter[0], final);
+			break;
+		}
+		return;
+	}
 
-	if (!*t->ebuf)
+	if (t->ninter)
 		return;
 
-	switch (*t->ebuf) {
-	case '#': /* ignore DECDHL, DECSWL, DECDWL, DECHCP, DECFPP */
-		if (t->elen == 2) {
-			if (lastchar == '8') { /* DECALN */
-				interpret_csi_ed(t, (int []){ 2 }, 1);
-				goto handled;
-			}
-			goto cancel;
-		}
-		break;
-	case '(':
-	case ')':
-		if (t->elen == 2) {
-			interpret_csi_scs(t);
-			goto handled;
-		}
-		break;
-	case ']': /* OSC - operating system command */
-		if (lastchar == '\a' ||
-		   (lastchar == '\\' && t->elen >= 2 && t->ebuf[t->elen - 2] == '\e')) {
-			t->elen -= lastchar == '\a' ? 1 : 2;
-			t->ebuf[t->elen] = '\0';
-			interpret_osc(t);
-			goto handled;
-		}
-		break;
-	case '[': /* CSI - control sequence introducer */
-		if (is_valid_csi_ender(lastchar)) {
-			interpret_csi(t);
-			goto handled;
-		}
-		break;
+	switch (final) {
 	case '7': /* DECSC: save cursor and attributes */
 		attributes_save(t);
 		cursor_save(t);
-		goto handled;
+		break;
 	case '8': /* DECRC: restore cursor and attributes */
 		attributes_restore(t);
 		cursor_restore(t);
-		goto handled;
+		break;
 	case 'D': /* IND: index */
 		interpret_csi_ind(t);
-		goto handled;
+		break;
 	case 'M': /* RI: reverse index */
 		interpret_csi_ri(t);
-		goto handled;
+		break;
 	case 'E': /* NEL: next line */
 		interpret_csi_nel(t);
-		goto handled;
+		break;
 	case 'H': /* HTS: horizontal tab set */
 		t->buffer->tabs[t->buffer->curs_col] = true;
-		goto handled;
+		break;
+	case '\\': /* ST: string terminator, the string was already handled */
+		break;
 	default:
-		goto cancel;
-	}
-
-	if (t->elen + 1 >= sizeof(t->ebuf)) {
-cancel:
 #ifndef NDEBUG
-		fprintf(stderr, "cancelled: \\033");
-		for (unsigned int i = 0; i < t->elen; i++) {
-			if (isprint(t->ebuf[i])) {
-				fputc(t->ebuf[i], stderr);
-			} else {
-				fprintf(stderr, "\\%03o", t->ebuf[i]);
-			}
-		}
-		fputc('\n', stderr);
+		fprintf(stderr, "unknown escape sequence: \\033%lc\n", (wint_t)final);
 #endif
-handled:
-		cancel_escape_sequence(t);
+		break;
 	}
 }
 
@@ -1276,9 +2054,6 @@ static void process_nonprinting(Vt *t, wchar_t wc)
 {
 	Buffer *b = t->buffer;
 	switch (wc) {
-	case '\e': /* ESC */
-		new_escape_sequence(t);
-		break;
 	case '\a': /* BEL */
 		if (t->urgent_handler)
 			t->urgent_handler(t);
@@ -1307,6 +2082,83 @@ static void process_nonprinting(Vt *t, wchar_t wc)
 	}
 }
 
+/* Decodes the UTF-8 sequence at the start of s. Returns the number of bytes
+ * consumed or 0 if s ends within an otherwise valid sequence. Invalid bytes
+ * and the maximal valid prefix of a broken sequence decode to U+FFFD.
+ */
+static size_t utf8_decode(const unsigned char *s, size_t len, wchar_t *wc)
+{
+	unsigned char c = s[0], lo = 0x80, hi = 0xbf;
+	size_t n;
+	wchar_t cp;
+
+	if (c < 0x80) {
+		*wc = c;
+		return 1;
+	} else if (c < 0xc2) {
+		goto invalid; /* continuation byte or overlong encoding */
+	} else if (c < 0xe0) {
+		n = 2;
+		cp = c & 0x1f;
+	} else if (c < 0xf0) {
+		n = 3;
+		cp = c & 0x0f;
+		if (c == 0xe0)
+			lo = 0xa0; /* overlong */
+		else if (c == 0xed)
+			hi = 0x9f; /* surrogates */
+	} else if (c < 0xf5) {
+		n = 4;
+		cp = c & 0x07;
+		if (c == 0xf0)
+			lo = 0x90; /* overlong */
+		else if (c == 0xf4)
+			hi = 0x8f; /* beyond U+10FFFF */
+	} else {
+		goto invalid;
+	}
+
+	for (size_t i = 1; i < n; i++) {
+		if (i == len)
+			return 0;
+		if (s[i] < lo || s[i] > hi) {
+			*wc = 0xfffd;
+			return i;
+		}
+		lo = 0x80;
+		hi = 0xbf;
+		cp = (cp << 6) | (s[i] & 0x3f);
+	}
+
+	*wc = cp;
+	return n;
+invalid:
+	*wc = 0xfffd;
+	return 1;
+}
+
+static size_t utf8_encode(char *s, wchar_t wc)
+{
+	if (wc < 0x80) {
+		s[0] = wc;
+		return 1;
+	} else if (wc < 0x800) {
+		s[0] = 0xc0 | (wc >> 6);
+		s[1] = 0x80 | (wc & 0x3f);
+		return 2;
+	} else if (wc < 0x10000) {
+		s[0] = 0xe0 | (wc >> 12);
+		s[1] = 0x80 | ((wc >> 6) & 0x3f);
+		s[2] = 0x80 | (wc & 0x3f);
+		return 3;
+	}
+	s[0] = 0xf0 | (wc >> 18);
+	s[1] = 0x80 | ((wc >> 12) & 0x3f);
+	s[2] = 0x80 | ((wc >> 6) & 0x3f);
+	s[3] = 0x80 | (wc & 0x3f);
+	return 4;
+}
+
 static void is_utf8_locale(void)
 {
 	const char *cset = nl_langinfo(CODESET);
@@ -1344,107 +2196,545 @@ static wchar_t get_vt100_graphic(char c)
 static void put_wc(Vt *t, wchar_t wc)
 {
 	int width = 0;
+	attr_t acs = A_NORMAL;
+
+	if (t->graphmode) {
+		if (wc >= 0x41 && wc <= 0x7e) {
+			wchar_t gc = get_vt100_graphic(wc);
+			/* outside of UTF-8 locales the code point of the cell only
+			 * keeps the character, the flag goes with the attributes */
+			if (gc & A_ALTCHARSET) {
+				wc = gc & A_CHARTEXT;
+				acs = A_ALTCHARSET;
+			} else if (gc) {
+				wc = gc;
+			}
+		}
+		width = 1;
+	} else if ((width = wcwidth(wc)) < 1) {
+		width = 1;
+	}
+	Buffer *b = t->buffer;
+	Cell blank_cell = { .attr = build_attrs(b->curattrs), .fg = b->curfg, .bg = b->curbg };
+	if (width == 2 && b->curs_col == b->cols - 1) {
+		row_dirty(b->curs_row, b->curs_col, b->curs_col + 1);
+		b->curs_row->cells[b->curs_col++] = blank_cell;
+		b->curs_row->used = MAX(b->curs_row->used, b->curs_col);
+	}
 
-	if (!t->seen_input) {
-		t->seen_input = 1;
-		kill(-t->pid, SIGWINCH);
+	if (b->curs_col >= b->cols) {
+		b->curs_col = 0;
+		cursor_line_down(t);
 	}
 
-	if (t->escaped) {
-		if (t->elen + 1 < sizeof(t->ebuf)) {
-			t->ebuf[t->elen] = wc;
-			t->ebuf[++t->elen] = '\0';
-			try_interpret_escape_seq(t);
-		} else {
-			cancel_escape_sequence(t);
-		}
-	} else if (IS_CONTROL(wc)) {
+	if (t->insert) {
+		Cell *src = b->curs_row->cells + b->curs_col;
+		Cell *dest = src + width;
+		size_t len = b->cols - b->curs_col - width;
+		memmove(dest, src, len * sizeof *dest);
+		row_dirty(b->curs_row, b->curs_col, b->cols);
+		b->curs_row->used = MAX(b->curs_row->used, b->cols);
+	}
+
+	row_dirty(b->curs_row, b->curs_col, b->curs_col + width);
+	b->curs_row->cells[b->curs_col] = blank_cell;
+	b->curs_row->cells[b->curs_col].wide = (width == 2);
+	b->curs_row->cells[b->curs_col].attr |= acs >> CELL_ATTR_SHIFT;
+	b->curs_row->cells[b->curs_col++].text = wc;
+	if (width == 2)
+		b->curs_row->cells[b->curs_col++] = blank_cell;
+	b->curs_row->used = MAX(b->curs_row->used, b->curs_col);
+}
+
+/* actions which are performed upon a state transition */
+enum {
+	ACTION_IGNORE,
+	ACTION_PRINT,
+	ACTION_EXECUTE,
+	ACTION_COLLECT,
+	ACTION_PARAM,
+	ACTION_ESC_DISPATCH,
+	ACTION_CSI_DISPATCH,
+	ACTION_OSC_PUT,
+};
+
+/* character classes in addition to the 7-bit ones */
+enum {
+	CLASS_UNICODE = 0x80,  /* printable character outside of ASCII */
+	CLASS_C1,              /* 8-bit control character, ignored */
+	CLASS_COUNT,
+};
+
+#define TRANS(action, state) ((action) << 4 | (state))
+#define C0(action, state) \
+	[0x00 ... 0x17] = TRANS(action, state), \
+	[0x19]          = TRANS(action, state), \
+	[0x1c ... 0x1f] = TRANS(action, state)
+#define ANYWHERE(state) \
+	[0x18]          = TRANS(ACTION_EXECUTE, STATE_GROUND), \
+	[0x1a]          = TRANS(ACTION_EXECUTE, STATE_GROUND), \
+	[0x1b]          = TRANS(ACTION_IGNORE, STATE_ESCAPE), \
+	[CLASS_C1]      = TRANS(ACTION_IGNORE, state)
+
+/* action and next state indexed by current state and character class,
+ * the entry and exit actions of a state are performed by vt_parse */
+static const unsigned char vt_parser_table[STATE_COUNT][CLASS_COUNT] = {
+	[STATE_GROUND] = {
+		ANYWHERE(STATE_GROUND),
+		C0(ACTION_EXECUTE, STATE_GROUND),
+		[0x20 ... 0x7e] = TRANS(ACTION_PRINT, STATE_GROUND),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_GROUND),
+		[CLASS_UNICODE] = TRANS(ACTION_PRINT, STATE_GROUND),
+	},
+	[STATE_ESCAPE] = {
+		ANYWHERE(STATE_ESCAPE),
+		C0(ACTION_EXECUTE, STATE_ESCAPE),
+		[0x20 ... 0x2f] = TRANS(ACTION_COLLECT, STATE_ESCAPE_INTERMEDIATE),
+		[0x30 ... 0x4f] = TRANS(ACTION_ESC_DISPATCH, STATE_GROUND),
+		[0x50]          = TRANS(ACTION_IGNORE, STATE_DCS_ENTRY),
+		[0x51 ... 0x57] = TRANS(ACTION_ESC_DISPATCH, STATE_GROUND),
+		[0x58]          = TRANS(ACTION_IGNORE, STATE_SOS_PM_APC_STRING),
+		[0x59 ... 0x5a] = TRANS(ACTION_ESC_DISPATCH, STATE_GROUND),
+		[0x5b]          = TRANS(ACTION_IGNORE, STATE_CSI_ENTRY),
+		[0x5c]          = TRANS(ACTION_ESC_DISPATCH, STATE_GROUND),
+		[0x5d]          = TRANS(ACTION_IGNORE, STATE_OSC_STRING),
+		[0x5e ... 0x5f] = TRANS(ACTION_IGNORE, STATE_SOS_PM_APC_STRING),
+		[0x60 ... 0x7e] = TRANS(ACTION_ESC_DISPATCH, STATE_GROUND),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_ESCAPE),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_ESCAPE),
+	},
+	[STATE_ESCAPE_INTERMEDIATE] = {
+		ANYWHERE(STATE_ESCAPE_INTERMEDIATE),
+		C0(ACTION_EXECUTE, STATE_ESCAPE_INTERMEDIATE),
+		[0x20 ... 0x2f] = TRANS(ACTION_COLLECT, STATE_ESCAPE_INTERMEDIATE),
+		[0x30 ... 0x7e] = TRANS(ACTION_ESC_DISPATCH, STATE_GROUND),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_ESCAPE_INTERMEDIATE),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_ESCAPE_INTERMEDIATE),
+	},
+	[STATE_CSI_ENTRY] = {
+		ANYWHERE(STATE_CSI_ENTRY),
+		C0(ACTION_EXECUTE, STATE_CSI_ENTRY),
+		[0x20 ... 0x2f] = TRANS(ACTION_COLLECT, STATE_CSI_INTERMEDIATE),
+		[0x30 ... 0x3b] = TRANS(ACTION_PARAM, STATE_CSI_PARAM),
+		[0x3c ... 0x3f] = TRANS(ACTION_COLLECT, STATE_CSI_PARAM),
+		[0x40 ... 0x7e] = TRANS(ACTION_CSI_DISPATCH, STATE_GROUND),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_CSI_ENTRY),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_CSI_ENTRY),
+	},
+	[STATE_CSI_PARAM] = {
+		ANYWHERE(STATE_CSI_PARAM),
+		C0(ACTION_EXECUTE, STATE_CSI_PARAM),
+		[0x20 ... 0x2f] = TRANS(ACTION_COLLECT, STATE_CSI_INTERMEDIATE),
+		[0x30 ... 0x3b] = TRANS(ACTION_PARAM, STATE_CSI_PARAM),
+		[0x3c ... 0x3f] = TRANS(ACTION_IGNORE, STATE_CSI_IGNORE),
+		[0x40 ... 0x7e] = TRANS(ACTION_CSI_DISPATCH, STATE_GROUND),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_CSI_PARAM),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_CSI_PARAM),
+	},
+	[STATE_CSI_INTERMEDIATE] = {
+		ANYWHERE(STATE_CSI_INTERMEDIATE),
+		C0(ACTION_EXECUTE, STATE_CSI_INTERMEDIATE),
+		[0x20 ... 0x2f] = TRANS(ACTION_COLLECT, STATE_CSI_INTERMEDIATE),
+		[0x30 ... 0x3f] = TRANS(ACTION_IGNORE, STATE_CSI_IGNORE),
+		[0x40 ... 0x7e] = TRANS(ACTION_CSI_DISPATCH, STATE_GROUND),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_CSI_INTERMEDIATE),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_CSI_INTERMEDIATE),
+	},
+	[STATE_CSI_IGNORE] = {
+		ANYWHERE(STATE_CSI_IGNORE),
+		C0(ACTION_EXECUTE, STATE_CSI_IGNORE),
+		[0x20 ... 0x3f] = TRANS(ACTION_IGNORE, STATE_CSI_IGNORE),
+		[0x40 ... 0x7e] = TRANS(ACTION_IGNORE, STATE_GROUND),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_CSI_IGNORE),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_CSI_IGNORE),
+	},
+	/* device control strings are not supported, they are parsed and dropped */
+	[STATE_DCS_ENTRY] = {
+		ANYWHERE(STATE_DCS_ENTRY),
+		C0(ACTION_IGNORE, STATE_DCS_ENTRY),
+		[0x20 ... 0x2f] = TRANS(ACTION_IGNORE, STATE_DCS_INTERMEDIATE),
+		[0x30 ... 0x39] = TRANS(ACTION_IGNORE, STATE_DCS_PARAM),
+		[0x3a]          = TRANS(ACTION_IGNORE, STATE_DCS_IGNORE),
+		[0x3b ... 0x3f] = TRANS(ACTION_IGNORE, STATE_DCS_PARAM),
+		[0x40 ... 0x7e] = TRANS(ACTION_IGNORE, STATE_DCS_PASSTHROUGH),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_DCS_ENTRY),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_DCS_ENTRY),
+	},
+	[STATE_DCS_PARAM] = {
+		ANYWHERE(STATE_DCS_PARAM),
+		C0(ACTION_IGNORE, STATE_DCS_PARAM),
+		[0x20 ... 0x2f] = TRANS(ACTION_IGNORE, STATE_DCS_INTERMEDIATE),
+		[0x30 ... 0x39] = TRANS(ACTION_IGNORE, STATE_DCS_PARAM),
+		[0x3a]          = TRANS(ACTION_IGNORE, STATE_DCS_IGNORE),
+		[0x3b]          = TRANS(ACTION_IGNORE, STATE_DCS_PARAM),
+		[0x3c ... 0x3f] = TRANS(ACTION_IGNORE, STATE_DCS_IGNORE),
+		[0x40 ... 0x7e] = TRANS(ACTION_IGNORE, STATE_DCS_PASSTHROUGH),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_DCS_PARAM),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_DCS_PARAM),
+	},
+	[STATE_DCS_INTERMEDIATE] = {
+		ANYWHERE(STATE_DCS_INTERMEDIATE),
+		C0(ACTION_IGNORE, STATE_DCS_INTERMEDIATE),
+		[0x20 ... 0x2f] = TRANS(ACTION_IGNORE, STATE_DCS_INTERMEDIATE),
+		[0x30 ... 0x3f] = TRANS(ACTION_IGNORE, STATE_DCS_IGNORE),
+		[0x40 ... 0x7e] = TRANS(ACTION_IGNORE, STATE_DCS_PASSTHROUGH),
+		[0x7f]          = TRANS(ACTION_IGNORE, STATE_DCS_INTERMEDIATE),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_DCS_INTERMEDIATE),
+	},
+	[STATE_DCS_PASSTHROUGH] = {
+		ANYWHERE(STATE_DCS_PASSTHROUGH),
+		C0(ACTION_IGNORE, STATE_DCS_PASSTHROUGH),
+		[0x20 ... 0x7f] = TRANS(ACTION_IGNORE, STATE_DCS_PASSTHROUGH),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_DCS_PASSTHROUGH),
+	},
+	[STATE_DCS_IGNORE] = {
+		ANYWHERE(STATE_DCS_IGNORE),
+		C0(ACTION_IGNORE, STATE_DCS_IGNORE),
+		[0x20 ... 0x7f] = TRANS(ACTION_IGNORE, STATE_DCS_IGNORE),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_DCS_IGNORE),
+	},
+	/* besides by ST (ESC \) xterm also terminates the string by BEL */
+	[STATE_OSC_STRING] = {
+		ANYWHERE(STATE_OSC_STRING),
+		[0x00 ... 0x06] = TRANS(ACTION_IGNORE, STATE_OSC_STRING),
+		[0x07]          = TRANS(ACTION_IGNORE, STATE_GROUND),
+		[0x08 ... 0x17] = TRANS(ACTION_IGNORE, STATE_OSC_STRING),
+		[0x19]          = TRANS(ACTION_IGNORE, STATE_OSC_STRING),
+		[0x1c ... 0x1f] = TRANS(ACTION_IGNORE, STATE_OSC_STRING),
+		[0x20 ... 0x7f] = TRANS(ACTION_OSC_PUT, STATE_OSC_STRING),
+		[CLASS_UNICODE] = TRANS(ACTION_OSC_PUT, STATE_OSC_STRING),
+	},
+	[STATE_SOS_PM_APC_STRING] = {
+		ANYWHERE(STATE_SOS_PM_APC_STRING),
+		C0(ACTION_IGNORE, STATE_SOS_PM_APC_STRING),
+		[0x20 ... 0x7f] = TRANS(ACTION_IGNORE, STATE_SOS_PM_APC_STRING),
+		[CLASS_UNICODE] = TRANS(ACTION_IGNORE, STATE_SOS_PM_APC_STRING),
+	},
+};
+
+static void vt_parse(Vt *t, wchar_t wc)
+{
+	int class = wc < 0x80 ? (int)wc : (wc < 0xa0 ? CLASS_C1 : CLASS_UNICODE);
+	unsigned char trans = vt_parser_table[t->state][class];
+	unsigned char state = trans & 0xf;
+
+	/* exit action of the current state */
+	if (state != t->state && t->state == STATE_OSC_STRING) {
+		t->osc[t->osclen] = '\0';
+		interpret_osc(t);
+	}
+
+	switch (trans >> 4) {
+	case ACTION_PRINT:
+		put_wc(t, wc);
+		break;
+	case ACTION_EXECUTE:
 		process_nonprinting(t, wc);
-	} else {
-		if (t->graphmode) {
-			if (wc >= 0x41 && wc <= 0x7e) {
-				wchar_t gc = get_vt100_graphic(wc);
-				if (gc)
-					wc = gc;
+		break;
+	case ACTION_COLLECT:
+		if (t->ninter < LENGTH(t->inter))
+			t->inter[t->ninter] = wc;
+		t->ninter++;
+		break;
+	case ACTION_PARAM:
+		/* parameters are separated by ; or : and saturate instead
+		 * of overflowing, excess parameters are dropped */
+		if (t->nparams == 0)
+			t->params[t->nparams++] = 0;
+		if (wc == ';' || wc == ':') {
+			if (t->nparams < LENGTH(t->params)) {
+				t->params[t->nparams] = 0;
+				if (wc == ':')
+					t->colons |= 1u << t->nparams;
 			}
-			width = 1;
-		} else if ((width = wcwidth(wc)) < 1) {
-			width = 1;
+			t->nparams++;
+		} else if (t->nparams <= LENGTH(t->params)) {
+			int *param = &t->params[t->nparams - 1];
+			*param = MIN(*param * 10 + (int)(wc - '0'), USHRT_MAX);
+		}
+		break;
+	case ACTION_ESC_DISPATCH:
+		interpret_esc(t, wc);
+		break;
+	case ACTION_CSI_DISPATCH:
+		interpret_csi(t, wc);
+		break;
+	case ACTION_OSC_PUT: {
+		/* overlong strings are truncated instead of dropped */
+		char buf[MB_LEN_MAX];
+		size_t len = 1;
+		mbstate_t ps;
+		memset(&ps, 0, sizeof(ps));
+		if (is_utf8)
+			len = utf8_encode(buf, wc);
+		else if ((len = wcrtomb(buf, wc, &ps)) == (size_t)-1) {
+			buf[0] = wc;
+			len = 1;
 		}
-		Buffer *b = t->buffer;
-		Cell blank_cell = { L'\0', build_attrs(b->curattrs), b->curfg, b->curbg };
-		if (width == 2 && b->curs_col == b->cols - 1) {
-			b->curs_row->cells[b->curs_col++] = blank_cell;
-			b->curs_row->dirty = true;
+		if (t->osclen + len < sizeof(t->osc)) {
+			memcpy(t->osc + t->osclen, buf, len);
+			t->osclen += len;
 		}
+		break;
+	}
+	}
+
+	/* entry action of the new state */
+	if (state != t->state) {
+		switch (state) {
+		case STATE_ESCAPE:
+		case STATE_CSI_ENTRY:
+		case STATE_DCS_ENTRY:
+			t->nparams = 0;
+			t->colons = 0;
+			t->ninter = 0;
+			break;
+		case STATE_OSC_STRING:
+			t->osclen = 0;
+			break;
+		}
+		t->state = state;
+	}
+}
+
+/* returns the length of the leading run of printable ASCII characters */
+static size_t ascii_run(const char *s, size_t len)
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	const __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f);
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		/* signed compares, bytes >= 0x80 are negative and thus fail */
+		__m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+		unsigned mask = _mm256_movemask_epi8(ok);
+		if (mask != 0xffffffff)
+			return i + __builtin_ctz(~mask);
+	}
+#elif defined __SSE2__
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		/* signed compares, bytes >= 0x80 are negative and thus fail */
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+		unsigned mask = _mm_movemask_epi8(ok);
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+#endif
+	for (; i < len; i++) {
+		unsigned char c = s[i];
+		if (c < 0x20 || c >= 0x7f)
+			break;
+	}
+	return i;
+}
 
+/* bulk version of put_wc for a run of printable ASCII characters, only
+ * valid outside of escape sequences, insert and graphics mode */
+static void put_ascii(Vt *t, const char *s, size_t len)
+{
+	Buffer *b = t->buffer;
+	Cell cell = { .attr = build_attrs(b->curattrs), .fg = b->curfg, .bg = b->curbg };
+
+	while (len > 0) {
 		if (b->curs_col >= b->cols) {
 			b->curs_col = 0;
 			cursor_line_down(t);
 		}
 
-		if (t->insert) {
-			Cell *src = b->curs_row->cells + b->curs_col;
-			Cell *dest = src + width;
-			size_t len = b->cols - b->curs_col - width;
-			memmove(dest, src, len * sizeof *dest);
+		Row *row = b->curs_row;
+		size_t n = MIN(len, (size_t)(b->cols - b->curs_col));
+		Cell *c = row->cells + b->curs_col;
+		for (size_t i = 0; i < n; i++) {
+			cell.text = (unsigned char)s[i];
+			c[i] = cell;
 		}
+		row_dirty(row, b->curs_col, b->curs_col + n);
+		b->curs_col += n;
+		row->used = MAX(row->used, b->curs_col);
+		s += n;
+		len -= n;
+	}
+}
 
-		b->curs_row->cells[b->curs_col] = blank_cell;
-		b->curs_row->cells[b->curs_col++].text = wc;
-		b->curs_row->dirty = true;
-		if (width == 2)
-			b->curs_row->cells[b->curs_col++] = blank_cell;
+/* keeps the history of the terminal within its own budget, or trims the
+ * history of the terminals viewed least recently until all those sharing
+ * the global budget fit into it */
+static void history_trim(Vt *t)
+{
+	if (t->history_budget) {
+		while (t->buffer_normal.history > t->history_budget &&
+		       buffer_history_trim(&t->buffer_normal));
+		return;
+	}
+	while (history_budget && history_total > history_budget) {
+		Vt *victim = NULL;
+		for (Vt *v = vts; v; v = v->next) {
+			if (v->buffer_normal.shared && v->buffer_normal.scroll_above &&
+			    (!victim || v->viewed < victim->viewed))
+				victim = v;
+		}
+		if (!victim)
+			return;
+		while (history_total > history_budget && buffer_history_trim(&victim->buffer_normal));
 	}
 }
 
-int vt_process(Vt *t)
+static void damage(Vt *t)
 {
-	int res;
-	unsigned int pos = 0;
+	if (t->damaged)
+		return;
+	t->damaged = 1;
+	if (t->damage_handler)
+		t->damage_handler(t);
+}
+
+/* decodes and interprets len bytes which were read after the carried ones */
+static void process_input(Vt *t, size_t len)
+{
+	/* Input is decoded by the built-in UTF-8 decoder when the locale uses
+	 * it, otherwise by mbrtowc. Bytes which are not valid in the locale
+	 * are printed as they are instead of being taken as C1 controls. */
+	const unsigned char *s = (unsigned char *)t->rbuf, *end = s + t->rlen + len;
 	mbstate_t ps;
 	memset(&ps, 0, sizeof(ps));
+	while (s < end) {
+		wchar_t wc;
+		size_t n = 1;
+
+		if (t->state == STATE_GROUND && !t->graphmode && !t->insert) {
+			size_t n = ascii_run((const char *)s, end - s);
+			if (n > 0) {
+				put_ascii(t, (const char *)s, n);
+				s += n;
+				continue;
+			}
+		}
+
+		if (*s < 0x80) {
+			wc = *s;
+		} else if (is_utf8) {
+			if (!(n = utf8_decode(s, end - s, &wc)))
+				break;
+		} else if ((n = mbrtowc(&wc, (const char *)s, end - s, &ps)) == (size_t)-2) {
+			break;
+		} else if (n == (size_t)-1) {
+			memset(&ps, 0, sizeof(ps));
+			wc = *s++;
+			if (t->state == STATE_GROUND)
+				put_wc(t, wc);
+			else
+				vt_parse(t, wc);
+			continue;
+		}
+
+		s += n;
+		vt_parse(t, wc);
+	}
+
+	/* carry an incomplete trailing sequence over to the next read */
+	t->rlen = end - s;
+	memmove(t->rbuf, s, t->rlen);
+}
+
+/* Drains the pty until it would block or the read budget is exhausted. The
+ * read buffer is sized according to the amount of pending data to process
+ * it in as few batches as possible. */
+int vt_process(Vt *t)
+{
+	size_t total = 0;
 
 	if (t->pty < 0) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	res = read(t->pty, t->rbuf + t->rlen, sizeof(t->rbuf) - t->rlen);
-	if (res < 0)
-		return -1;
-
-	t->rlen += res;
-	while (pos < t->rlen) {
-		wchar_t wc;
-		ssize_t len;
+	while (total < read_budget) {
+		int pending = 0;
+		if (ioctl(t->pty, FIONREAD, &pending) == -1)
+			pending = BUFSIZ;
+		else if (pending == 0 && total > 0)
+			break;
+		size_t want = MIN(MAX((size_t)pending, BUFSIZ), read_budget - total);
+
+		if (t->rlen + want > t->rsize) {
+			size_t size = MAX(t->rlen + want, 2 * t->rsize);
+			char *rbuf = realloc(t->rbuf, size);
+			if (rbuf) {
+				t->rbuf = rbuf;
+				t->rsize = size;
+			} else if (t->rsize > t->rlen) {
+				want = t->rsize - t->rlen;
+			} else {
+				return -1;
+			}
+		}
 
-		len = (ssize_t)mbrtowc(&wc, t->rbuf + pos, t->rlen - pos, &ps);
-		if (len == -2) {
-			t->rlen -= pos;
-			memmove(t->rbuf, t->rbuf + pos, t->rlen);
-			return 0;
+		ssize_t res = read(t->pty, t->rbuf + t->rlen, want);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			/* report the error on the next call if data was read */
+			if (!total)
+				return -1;
+			break;
 		}
+		if (res == 0)
+			break;
 
-		if (len == -1) {
-			len = 1;
-			wc = t->rbuf[pos];
+		if (!t->seen_input) {
+			t->seen_input = 1;
+			kill(-t->pid, SIGWINCH);
 		}
 
-		pos += len ? len : 1;
-		put_wc(t, wc);
+		process_input(t, res);
+		total += res;
+	}
+
+	if (total) {
+		history_trim(t);
+		damage(t);
 	}
 
-	t->rlen -= pos;
-	memmove(t->rbuf, t->rbuf + pos, t->rlen);
 	return 0;
 }
 
+void vt_read_budget_set(size_t bytes)
+{
+	read_budget = bytes ? bytes : BUFSIZ;
+}
+
+void vt_spill_dir_set(const char *dir)
+{
+	spill_dir = dir && *dir ? dir : NULL;
+}
+
+void vt_history_budget_set(size_t bytes)
+{
+	history_budget = bytes;
+}
+
+void vt_history_limit_set(Vt *t, size_t bytes)
+{
+	Buffer *b = &t->buffer_normal;
+	if (b->shared && bytes)
+		history_total -= b->history;
+	else if (!b->shared && !bytes)
+		history_total += b->history;
+	b->shared = !bytes;
+	t->history_budget = bytes;
+	history_trim(t);
+}
+
 void vt_default_colors_set(Vt *t, attr_t attrs, short fg, short bg)
 {
 	t->defattrs = attrs;
 	t->deffg = fg;
 	t->defbg = bg;
+	memset(t->color_cache, 0, sizeof t->color_cache);
 }
 
 Vt *vt_create(int rows, int cols, int scroll_size)
@@ -1459,13 +2749,18 @@ Vt *vt_create(int rows, int cols, int scroll_size)
 	t->pty = -1;
 	t->deffg = t->defbg = -1;
 	t->buffer = &t->buffer_normal;
+	t->damaged = 1;
 
-	if (!buffer_init(&t->buffer_normal, rows, cols, scroll_size) ||
-	    !buffer_init(&t->buffer_alternate, rows, cols, 0)) {
+	t->buffer_normal.shared = true;
+	if (!buffer_init(&t->buffer_normal, rows, cols, scroll_size)) {
+		buffer_free(&t->buffer_normal);
 		free(t);
 		return NULL;
 	}
 
+	t->next = vts;
+	vts = t;
+
 	return t;
 }
 
@@ -1478,8 +2773,12 @@ void vt_resize(Vt *t, int rows, int cols)
 
 	vt_noscroll(t);
 	buffer_resize(&t->buffer_normal, rows, cols);
-	buffer_resize(&t->buffer_alternate, rows, cols);
+	if (t->buffer == &t->buffer_alternate)
+		buffer_resize(&t->buffer_alternate, rows, cols);
+	else
+		alternate_release(t);
 	cursor_clamp(t);
+	damage(t);
 	ioctl(t->pty, TIOCSWINSZ, &ws);
 	kill(-t->pid, SIGWINCH);
 }
@@ -1488,9 +2787,17 @@ void vt_destroy(Vt *t)
 {
 	if (!t)
 		return;
+	for (Vt **v = &vts; *v; v = &(*v)->next) {
+		if (*v == t) {
+			*v = t->next;
+			break;
+		}
+	}
 	buffer_free(&t->buffer_normal);
-	buffer_free(&t->buffer_alternate);
+	if (t->buffer_alternate.lines_buf)
+		buffer_free(&t->buffer_alternate);
 	close(t->pty);
+	free(t->rbuf);
 	free(t);
 }
 
@@ -1498,7 +2805,75 @@ void vt_dirty(Vt *t)
 {
 	Buffer *b = t->buffer;
 	for (Row *row = b->lines, *end = row + b->rows; row < end; row++)
-		row->dirty = true;
+		row_dirty(row, 0, INT_MAX);
+	damage(t);
+}
+
+/* RGB colors are only resolved on a miss, never once per cell */
+static short color_get_cached(Vt *t, uint16_t fg, uint16_t bg)
+{
+	unsigned int index = (fg * 31u + bg) % LENGTH(t->color_cache);
+	ColorCacheEntry *e = &t->color_cache[index];
+
+	if (e->generation != color_generation || e->fg != fg || e->bg != bg) {
+		e->pair = color_get(t, fg == CELL_COLOR_DEFAULT ? t->deffg : color_unpack(fg),
+		                    bg == CELL_COLOR_DEFAULT ? t->defbg : color_unpack(bg));
+		e->fg = fg;
+		e->bg = bg;
+		e->generation = color_generation;
+	} else {
+		color_pair_touch(e->pair);
+	}
+
+	return e->pair;
+}
+
+/* references the pairs the columns [start, end) of the row are about to be
+ * drawn with, pairs still on screen are never evicted. They are added to the
+ * ones the row holds already, only when the whole row is drawn or no pair
+ * is left those it was drawn with so far are released. */
+static void row_pairs_update(Vt *t, Row *row, int start, int end, int cols)
+{
+	bool all = (start == 0 && end == cols) || color_pairs_exhausted;
+	if (all) {
+		start = 0;
+		end = cols;
+	}
+	short pairs[end - start];
+	int n = 0, kept = all ? 0 : row->npairs;
+	for (const Cell *c = row->cells + start, *e = row->cells + end, *prev = NULL; c < e; prev = c++) {
+		if (prev && c->fg == prev->fg && c->bg == prev->bg)
+			continue;
+		short pair = color_get_cached(t, c->fg, c->bg);
+		int i;
+		for (i = 0; i < kept && row->pairs[i] != pair; i++);
+		if (!pair || i < kept)
+			continue;
+		for (i = 0; i < n && pairs[i] != pair; i++);
+		if (i == n) {
+			color_pair_ref(pair);
+			pairs[n++] = pair;
+		}
+	}
+
+	if (all) {
+		for (int i = 0; i < row->npairs; i++)
+			color_pair_unref(row->pairs[i]);
+		row->npairs = 0;
+	}
+	if (row->npairs + n > row->pairs_size) {
+		short *p = realloc(row->pairs, (row->npairs + n) * sizeof(*p));
+		if (!p) {
+			for (int i = 0; i < n; i++)
+				color_pair_unref(pairs[i]);
+			return;
+		}
+		row->pairs = p;
+		row->pairs_size = row->npairs + n;
+	}
+	if (n)
+		memcpy(row->pairs + row->npairs, pairs, n * sizeof(*pairs));
+	row->npairs += n;
 }
 
 void vt_draw(Vt *t, WINDOW *win, int srow, int scol)
@@ -1506,55 +2881,110 @@ void vt_draw(Vt *t, WINDOW *win, int srow, int scol)
 	Buffer *b = t->buffer;
 
 	if (srow != t->srow || scol != t->scol) {
+		t->damaged = 1; /* redrawn right away, nobody to notify */
 		vt_dirty(t);
 		t->srow = srow;
 		t->scol = scol;
 	}
 
-	for (int i = 0; i < b->rows; i++) {
+	/* cleared up front, evicting a color pair might damage it again */
+	bool damaged = t->damaged;
+	t->damaged = 0;
+
+	bool dirty = b->dirty;
+	if (damaged)
+		b->dirty = false;
+
+	for (int i = 0; damaged && i < b->rows; i++) {
 		Row *row = b->lines + i;
+		int start = row->dirty_start, end = MIN(row->dirty_end, b->cols);
 
-		if (!row->dirty)
+		if (dirty) {
+			start = 0;
+			end = b->cols;
+		}
+		row->dirty_start = row->dirty_end = 0;
+		if (start >= end)
 			continue;
-
-		wmove(win, srow + i, scol);
+		/* never start in the middle of a double width character and
+		 * include the cell which might still show the trailing half of
+		 * one whose leading half was overwritten */
+		if (start > 0 && row->cells[start - 1].wide)
+			start--;
+		if (end < b->cols)
+			end++;
+		row_pairs_update(t, row, start, end, b->cols);
+
+		/* in UTF-8 locales the span is converted into an array of
+		 * complex characters and written with one call, otherwise the
+		 * attributes are set once per run of identical cells */
+		cchar_t line[is_utf8 ? end - start : 1];
+		int n = 0, x = start;
+		attr_t attr = A_NORMAL;
+		short pair = 0;
+
+		wmove(win, srow + i, scol + start);
 		Cell *cell = NULL;
-		for (int j = 0; j < b->cols; j++) {
+		for (int j = start; j < end; j++) {
 			Cell *prev_cell = cell;
 			cell = row->cells + j;
 			if (!prev_cell || cell->attr != prev_cell->attr
 			    || cell->fg != prev_cell->fg
 			    || cell->bg != prev_cell->bg) {
-				if (cell->attr == A_NORMAL)
-					cell->attr = t->defattrs;
-				if (cell->fg == -1)
-					cell->fg = t->deffg;
-				if (cell->bg == -1)
-					cell->bg = t->defbg;
-				wattrset(win, cell->attr << NCURSES_ATTR_SHIFT);
-				wcolor_set(win, vt_color_get(t, cell->fg, cell->bg), NULL);
+				attr = cell->attr == A_NORMAL ? t->defattrs : cell_attrs(cell);
+				pair = color_get_cached(t, cell->fg, cell->bg);
+				if (!is_utf8) {
+					wattrset(win, attr);
+					wcolor_set(win, pair, NULL);
+				}
 			}
 
-			if (is_utf8 && cell->text >= 128) {
-				char buf[MB_CUR_MAX + 1];
-				size_t len = wcrtomb(buf, cell->text, NULL);
-				if (len > 0) {
-					waddnstr(win, buf, len);
-					if (wcwidth(cell->text) > 1)
+			if (is_utf8) {
+				wchar_t wc[CCHARW_MAX + 1] = { cell->text > ' ' ? cell->text : L' ' };
+				int width = 1;
+				/* everything below U+0300 is of single width */
+				if (cell->wide) {
+					width = 2;
+					j++;
+				} else if (wc[0] >= 0x300) {
+					width = wcwidth(wc[0]);
+					if (width == 0 && n > 0) {
+						/* attach combining characters to the preceding cell */
+						attr_t a;
+						short p;
+						wchar_t c = wc[0];
+						getcchar(&line[n - 1], wc, &a, &p, NULL);
+						size_t len = wcslen(wc);
+						if (len < CCHARW_MAX) {
+							wc[len] = c;
+							wc[len + 1] = L'\0';
+							setcchar(&line[n - 1], wc, a, p, NULL);
+						}
+						continue;
+					}
+					if (width == 0)
+						wc[0] = L' ';
+					if (width < 1)
+						width = 1;
+					else if (width > 1)
 						j++;
 				}
+				setcchar(&line[n++], wc, attr, pair, NULL);
+				x += width;
 			} else {
 				waddch(win, cell->text > ' ' ? cell->text : ' ');
 			}
 		}
 
-		int x, y;
-		getyx(win, y, x);
-		(void)y;
-		if (x && x < b->cols - 1)
-			whline(win, ' ', b->cols - x);
-
-		row->dirty = false;
+		if (is_utf8) {
+			wadd_wchnstr(win, line, n);
+			/* clear what is left over by combined characters */
+			if (end == b->cols && x < end) {
+				cchar_t blank;
+				setcchar(&blank, L" ", attr, pair, NULL);
+				mvwhline_set(win, srow + i, scol + x, &blank, end - x);
+			}
+		}
 	}
 
 	wmove(win, srow + b->curs_row - b->lines, scol + b->curs_col);
@@ -1574,6 +3004,8 @@ void vt_scroll(Vt *t, int rows)
 	}
 	buffer_scroll(b, rows);
 	b->scroll_below -= rows;
+	if (rows)
+		damage(t);
 }
 
 void vt_noscroll(Vt *t)
@@ -1583,6 +3015,43 @@ void vt_noscroll(Vt *t)
 		vt_scroll(t, scroll_below);
 }
 
+/* releases the color pairs of a terminal which is no longer shown, it is
+ * redrawn completely once it is drawn again */
+void vt_hide(Vt *t)
+{
+	buffer_pairs_release(&t->buffer_normal);
+	if (t->buffer_alternate.lines_buf)
+		buffer_pairs_release(&t->buffer_alternate);
+	for (Row *row = t->buffer->lines, *end = row + t->buffer->rows; row < end; row++)
+		row_dirty(row, 0, INT_MAX);
+	t->damaged = 1; /* nobody to notify while hidden */
+}
+
+/* releases the alternate screen buffers which were left long enough ago,
+ * returns the seconds until the next one is due or -1 if none is kept */
+int vt_idle(void)
+{
+	int due = -1;
+	time_t now = monotonic_seconds();
+
+	for (Vt *t = vts; t; t = t->next) {
+		if (t->buffer == &t->buffer_alternate || !t->buffer_alternate.lines_buf)
+			continue;
+		time_t left = t->alternate_left + ALTERNATE_LINGER - now;
+		if (left <= 0)
+			alternate_release(t);
+		else if (due == -1 || left < due)
+			due = left;
+	}
+	return due;
+}
+
+/* marks the terminal as looked at by the user, its history is trimmed last */
+void vt_viewed(Vt *t)
+{
+	t->viewed = ++view_clock;
+}
+
 pid_t vt_forkpty(Vt *t, const char *p, const char *argv[], const char *cwd, const char *env[], int *to, int *from)
 {
 	int vt2ed[2], ed2vt[2];
@@ -1640,6 +3109,8 @@ pid_t vt_forkpty(Vt *t, const char *p, const char *argv[], const char *cwd, cons
 		exit(1);
 	}
 
+	fcntl(t->pty, F_SETFL, fcntl(t->pty, F_GETFL) | O_NONBLOCK);
+
 	if (to) {
 		close(vt2ed[0]);
 		*to = vt2ed[1];
@@ -1665,7 +3136,9 @@ ssize_t vt_write(Vt *t, const char *buf, size_t len)
 	while (len > 0) {
 		ssize_t res = write(t->pty, buf, len);
 		if (res < 0) {
-			if (errno != EAGAIN && errno != EINTR)
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				poll(&(struct pollfd){ .fd = t->pty, .events = POLLOUT }, 1, -1);
+			else if (errno != EINTR)
 				return -1;
 			continue;
 		}
@@ -1750,56 +3223,321 @@ void vt_mouse(Vt *t, int x, int y, mmask_t mask)
 #endif /* NCURSES_MOUSE_VERSION */
 }
 
-static unsigned int color_hash(short fg, short bg)
+/* default xterm palette as 24-bit RGB values */
+static int color_palette_rgb(int color)
 {
-	if (fg == -1)
-		fg = COLORS;
-	if (bg == -1)
-		bg = COLORS + 1;
-	return fg * (COLORS + 2) + bg;
+	static const int ansi[16] = {
+		0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+		0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff,
+	};
+	static const int cube[6] = { 0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff };
+
+	if (color < 16)
+		return ansi[color];
+	if (color < 232) {
+		color -= 16;
+		return cube[color / 36] << 16 | cube[color / 6 % 6] << 8 | cube[color % 6];
+	}
+	int gray = 8 + (color - 232) * 10;
+	return gray << 16 | gray << 8 | gray;
+}
+
+/* nearest palette entry of a 24-bit color, memoized since terminals tend
+ * to use only a handful of distinct RGB values */
+static int color_rgb_nearest(int rgb)
+{
+	static struct {
+		int rgb;                /* including RGB_COLOR, so 0 is never valid */
+		short color;
+	} cache[256];
+	unsigned int index = ((rgb >> 16) * 31 + (rgb >> 8) * 7 + rgb) & (LENGTH(cache) - 1);
+
+	if (cache[index].rgb == rgb)
+		return cache[index].color;
+
+	/* the first 16 colors are commonly redefined, avoid them if possible */
+	int first = COLORS >= 256 ? 16 : 0, last = COLORS >= 256 ? 256 : MIN(COLORS, 16);
+	int r = (rgb >> 16) & 0xff, g = (rgb >> 8) & 0xff, b = rgb & 0xff;
+	int best = 0, best_dist = INT_MAX;
+	for (int i = first; i < last; i++) {
+		int p = color_palette_rgb(i);
+		int dr = r - ((p >> 16) & 0xff), dg = g - ((p >> 8) & 0xff), db = b - (p & 0xff);
+		int dist = 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+		if (dist < best_dist) {
+			best = i;
+			best_dist = dist;
+		}
+	}
+
+	cache[index].rgb = rgb;
+	cache[index].color = best;
+	return best;
+}
+
+/* Cell colors are encoded such that a blank cell in the default colors is
+ * all zero: 0 is the default color, palette entries follow and 24-bit colors
+ * are referenced by their index in a table shared by all terminals. Entries
+ * are never released, once the table is full further colors are approximated
+ * by the palette. */
+static unsigned int color_pack_slot(int color)
+{
+	unsigned int h = color * 2654435761u & (rgb_map_size - 1);
+	while (rgb_map[h] && rgb_colors[rgb_map[h] - 1] != color)
+		h = (h + 1) & (rgb_map_size - 1);
+	return h;
+}
+
+static uint16_t color_pack(int color)
+{
+	if (color == -1)
+		return CELL_COLOR_DEFAULT;
+	if (!(color & RGB_COLOR))
+		return color + 1;
+
+	unsigned int h = rgb_map ? color_pack_slot(color) : 0;
+	if (rgb_map && rgb_map[h])
+		return CELL_COLOR_RGB + rgb_map[h] - 1;
+	if (CELL_COLOR_RGB + rgb_count > UINT16_MAX)
+		return color_rgb_nearest(color) + 1;
+
+	if (2 * (rgb_count + 1) > rgb_map_size) {
+		unsigned int size = rgb_map_size ? 2 * rgb_map_size : 256;
+		int *colors = realloc(rgb_colors, size / 2 * sizeof *colors);
+		uint16_t *map = calloc(size, sizeof *map);
+		if (colors)
+			rgb_colors = colors;
+		if (!colors || !map) {
+			free(map);
+			return color_rgb_nearest(color) + 1;
+		}
+		free(rgb_map);
+		rgb_map = map;
+		rgb_map_size = size;
+		for (unsigned int i = 0; i < rgb_count; i++)
+			rgb_map[color_pack_slot(rgb_colors[i])] = i + 1;
+		h = color_pack_slot(color);
+	}
+
+	rgb_colors[rgb_count] = color;
+	rgb_map[h] = ++rgb_count;
+	return CELL_COLOR_RGB + rgb_count - 1;
 }
 
-short vt_color_get(Vt *t, short fg, short bg)
+/* returns -1, a palette index or an RGB_COLOR value */
+static int color_unpack(uint16_t color)
+{
+	if (color == CELL_COLOR_DEFAULT)
+		return -1;
+	if (color >= CELL_COLOR_RGB)
+		return rgb_colors[color - CELL_COLOR_RGB];
+	return color - 1;
+}
+
+/* converts a cell color to a curses color number */
+static int color_resolve(int color)
+{
+	if (color == -1)
+		return color;
+	if (has_direct_colors) {
+		/* direct color terminals only keep the first 8 palette entries */
+		if (color & RGB_COLOR)
+			color &= ~RGB_COLOR;
+		else if (color >= 8 && color < 256)
+			color = color_palette_rgb(color);
+		else
+			return color;
+		return MAX(color, 8);
+	}
+	if (color & RGB_COLOR)
+		return color_rgb_nearest(color);
+	return color;
+}
+
+/* maps default and out of range colors to the ones the pair is initialized with */
+static void color_normalize(Vt *t, int *fg, int *bg)
 {
-	if (fg >= COLORS)
-		fg = (t ? t->deffg : default_fg);
-	if (bg >= COLORS)
-		bg = (t ? t->defbg : default_bg);
+	*fg = color_resolve(*fg);
+	*bg = color_resolve(*bg);
+
+	if (*fg >= COLORS)
+		*fg = (t ? t->deffg : default_fg);
+	if (*bg >= COLORS)
+		*bg = (t ? t->defbg : default_bg);
 
 	if (!has_default_colors) {
-		if (fg == -1)
-			fg = (t && t->deffg != -1 ? t->deffg : default_fg);
-		if (bg == -1)
-			bg = (t && t->defbg != -1 ? t->defbg : default_bg);
+		if (*fg == -1)
+			*fg = (t && t->deffg != -1 ? t->deffg : default_fg);
+		if (*bg == -1)
+			*bg = (t && t->defbg != -1 ? t->defbg : default_bg);
 	}
+}
 
-	if (!color2palette || (fg == -1 && bg == -1))
-		return 0;
-	unsigned int index = color_hash(fg, bg);
-	if (color2palette[index] == 0) {
-		short oldfg, oldbg;
-		for (;;) {
-			if (++color_pair_current >= color_pairs_max)
-				color_pair_current = color_pairs_reserved + 1;
-			pair_content(color_pair_current, &oldfg, &oldbg);
-			unsigned int old_index = color_hash(oldfg, oldbg);
-			if (color2palette[old_index] >= 0) {
-				if (init_pair(color_pair_current, fg, bg) == OK) {
-					color2palette[old_index] = 0;
-					color2palette[index] = color_pair_current;
+static unsigned int color_hash(int fg, int bg)
+{
+	return ((unsigned int)fg * 2654435761u ^ (unsigned int)bg * 40503u) & color_map_mask;
+}
+
+/* returns the slot holding the pair for the given colors or the empty one
+ * where it would have to be inserted, the table is never full */
+static short *color_map_find(int fg, int bg)
+{
+	for (unsigned int i = color_hash(fg, bg);; i = (i + 1) & color_map_mask) {
+		short pair = color_map[i];
+		if (!pair || (color_pairs[pair].fg == fg && color_pairs[pair].bg == bg))
+			return &color_map[i];
+	}
+}
+
+static void color_map_remove(short *slot)
+{
+	unsigned int i = slot - color_map, j = i;
+
+	/* move following entries of the probe sequence back into the gap */
+	for (;;) {
+		j = (j + 1) & color_map_mask;
+		short pair = color_map[j];
+		if (!pair)
+			break;
+		unsigned int home = color_hash(color_pairs[pair].fg, color_pairs[pair].bg);
+		if (i < j ? (home <= i || home > j) : (home <= i && home > j)) {
+			color_map[i] = pair;
+			i = j;
+		}
+	}
+
+	color_map[i] = 0;
+}
+
+static void color_lru_unlink(short pair)
+{
+	ColorPair *p = &color_pairs[pair];
+	if (p->prev)
+		color_pairs[p->prev].next = p->next;
+	else
+		color_lru_head = p->next;
+	if (p->next)
+		color_pairs[p->next].prev = p->prev;
+	else
+		color_lru_tail = p->prev;
+	p->prev = p->next = 0;
+}
+
+static void color_lru_push(short pair)
+{
+	ColorPair *p = &color_pairs[pair];
+	p->prev = 0;
+	p->next = color_lru_head;
+	if (color_lru_head)
+		color_pairs[color_lru_head].prev = pair;
+	else
+		color_lru_tail = pair;
+	color_lru_head = pair;
+}
+
+/* only pairs no visible row refers to are kept in the LRU list */
+static void color_pair_touch(short pair)
+{
+	ColorPair *p = &color_pairs[pair];
+	if (pair && pair != color_lru_head && !p->reserved && !p->refs) {
+		color_lru_unlink(pair);
+		color_lru_push(pair);
+	}
+}
+
+static void color_pair_ref(short pair)
+{
+	ColorPair *p = &color_pairs[pair];
+	if (!p->refs++ && !p->reserved)
+		color_lru_unlink(pair);
+}
+
+static void color_pair_unref(short pair)
+{
+	ColorPair *p = &color_pairs[pair];
+	if (!--p->refs && !p->reserved) {
+		color_lru_push(pair);
+		if (color_pairs_exhausted) {
+			/* redraw the colors drawn without a pair to give them one */
+			color_pairs_exhausted = false;
+			color_generation++;
+			for (Vt *t = vts; t; t = t->next) {
+				if (t->pairs_missing) {
+					t->pairs_missing = 0;
+					vt_dirty(t);
 				}
-				break;
 			}
 		}
 	}
+}
+
+/* returns an unused pair or evicts the least recently used unreferenced
+ * one, 0 if all of them are still on screen */
+static short color_pair_alloc(void)
+{
+	if (color_pairs_used + 1 < color_pairs_max)
+		return ++color_pairs_used;
+
+	short pair = color_lru_tail;
+	if (!pair) {
+		color_pairs_exhausted = true;
+		return 0;
+	}
 
-	short color_pair = color2palette[index];
-	return color_pair >= 0 ? color_pair : -color_pair;
+	ColorPair *p = &color_pairs[pair];
+	color_lru_unlink(pair);
+	color_map_remove(color_map_find(p->fg, p->bg));
+	color_generation++;
+	return pair;
 }
 
-short vt_color_reserve(short fg, short bg)
+static short color_pair_new(int fg, int bg, bool reserved)
+{
+	short pair = color_pair_alloc();
+#ifdef HAVE_EXTENDED_PAIRS
+	if (!pair || init_extended_pair(pair, fg, bg) == ERR)
+#else
+	if (!pair || init_pair(pair, fg, bg) == ERR)
+#endif
+		return 0;
+
+	ColorPair *p = &color_pairs[pair];
+	p->fg = fg;
+	p->bg = bg;
+	p->reserved = reserved;
+	*color_map_find(fg, bg) = pair;
+	if (!reserved)
+		color_lru_push(pair);
+	return pair;
+}
+
+static short color_get(Vt *t, int fg, int bg)
 {
-	if (!color2palette || fg >= COLORS || bg >= COLORS)
+	color_normalize(t, &fg, &bg);
+
+	if (!color_pairs || (fg == -1 && bg == -1))
+		return 0;
+
+	short pair = *color_map_find(fg, bg);
+	if (!pair) {
+		pair = color_pair_new(fg, bg, false);
+		if (!pair && color_pairs_exhausted)
+			t->pairs_missing = 1;
+		return pair;
+	}
+	color_pair_touch(pair);
+	return pair;
+}
+
+short vt_color_get(Vt *t, short fg, short bg)
+{
+	return color_get(t, fg, bg);
+}
+
+static short color_reserve(int fg, int bg)
+{
+	fg = color_resolve(fg);
+	bg = color_resolve(bg);
+	if (!color_pairs || fg >= COLORS || bg >= COLORS)
 		return 0;
 	if (!has_default_colors && fg == -1)
 		fg = default_fg;
@@ -1807,13 +3545,21 @@ short vt_color_reserve(short fg, short bg)
 		bg = default_bg;
 	if (fg == -1 && bg == -1)
 		return 0;
-	unsigned int index = color_hash(fg, bg);
-	if (color2palette[index] >= 0) {
-		if (init_pair(color_pairs_reserved + 1, fg, bg) == OK)
-			color2palette[index] = -(++color_pairs_reserved);
+
+	short pair = *color_map_find(fg, bg);
+	if (!pair)
+		return color_pair_new(fg, bg, true);
+	if (!color_pairs[pair].reserved) {
+		if (!color_pairs[pair].refs)
+			color_lru_unlink(pair);
+		color_pairs[pair].reserved = true;
 	}
-	short color_pair = color2palette[index];
-	return color_pair >= 0 ? color_pair : -color_pair;
+	return pair;
+}
+
+short vt_color_reserve(short fg, short bg)
+{
+	return color_reserve(fg, bg);
 }
 
 static void init_colors(void)
@@ -1824,17 +3570,32 @@ static void init_colors(void)
 	if (default_bg == -1)
 		default_bg = COLOR_BLACK;
 	has_default_colors = (use_default_colors() == OK);
+#ifdef HAVE_EXTENDED_PAIRS
+	/* ncurses reports direct color terminals with the RGB capability */
+	has_direct_colors = COLORS >= 0x1000000 && tigetflag("RGB") > 0;
+#endif
 	color_pairs_max = MIN(MAX_COLOR_PAIRS, SHRT_MAX);
-	if (COLORS)
-		color2palette = calloc((COLORS + 2) * (COLORS + 2), sizeof(short));
+	if (COLORS && color_pairs_max > 1) {
+		unsigned int size = 1;
+		while (size < 2u * color_pairs_max)
+			size <<= 1;
+		color_pairs = calloc(color_pairs_max, sizeof *color_pairs);
+		color_map = calloc(size, sizeof *color_map);
+		color_map_mask = size - 1;
+		if (!color_pairs || !color_map) {
+			free(color_pairs);
+			free(color_map);
+			color_pairs = NULL;
+			color_map = NULL;
+		}
+	}
 	/*
 	 * XXX: On undefined color-pairs NetBSD curses pair_content() set fg
 	 *      and bg to default colors while ncurses set them respectively to
-	 *      0 and 0. Initialize all color-pairs in order to have consistent
-	 *      behaviour despite the implementation used.
+	 *      0 and 0. Pairs are therefore never queried, their colors are
+	 *      recorded in color_pairs and slots up to color_pairs_used are
+	 *      the only ones ever initialized, lazily when first handed out.
 	 */
-	for (short i = 1; i < color_pairs_max; i++)
-		init_pair(i, 0, 0);
 	vt_color_reserve(COLOR_WHITE, COLOR_BLACK);
 }
 
@@ -1859,7 +3620,10 @@ void vt_keytable_set(const char * const keytable_overlay[], int count)
 
 void vt_shutdown(void)
 {
-	free(color2palette);
+	free(color_pairs);
+	free(color_map);
+	free(rgb_colors);
+	free(rgb_map);
 }
 
 void vt_title_handler_set(Vt *t, vt_title_handler_t handler)
@@ -1872,6 +3636,13 @@ void vt_urgent_handler_set(Vt *t, vt_urgent_handler_t handler)
 	t->urgent_handler = handler;
 }
 
+void vt_damage_handler_set(Vt *t, vt_damage_handler_t handler)
+{
+	t->damage_handler = handler;
+	if (handler && t->damaged)
+		handler(t);
+}
+
 void vt_data_set(Vt *t, void *data)
 {
 	t->data = data;
@@ -1904,20 +3675,33 @@ size_t vt_content_get(Vt *t, char **buf, bool colored)
 		return 0;
 
 	char *s = *buf;
-	Cell *prev_cell = NULL;
+	Cell *prev_cell = NULL, prev;
 
-	for (Row *row = buffer_row_first(b); row; row = buffer_row_next(b, row)) {
+	Cell cells[b->cols];
+	Row unpacked = { .cells = cells, .size = b->cols, .used = b->cols };
+
+	for (int i = -b->scroll_above; i < b->rows + b->scroll_below; i++) {
 		size_t len = 0;
 		char *last_non_space = s;
+		Row *row = &unpacked;
+		if (i >= 0 && i < b->rows) {
+			row = b->lines + i;
+		} else {
+			/* history lines are counted from scroll_index */
+			int idx = (b->scroll_index + (i < 0 ? i : i - b->rows) + b->scroll_size) % b->scroll_size;
+			buffer_chunk_use(b, idx / CHUNK_LINES);
+			line_unpack(b->scroll_buf[idx], &unpacked);
+		}
 		for (int col = 0; col < b->cols; col++) {
 			Cell *cell = row->cells + col;
 			if (colored) {
 				int esclen = 0;
 				if (!prev_cell || cell->attr != prev_cell->attr) {
-					attr_t attr = cell->attr << NCURSES_ATTR_SHIFT;
-					esclen = sprintf(s, "\033[0%s%s%s%s%s%sm",
+					attr_t attr = cell_attrs(cell);
+					esclen = sprintf(s, "\033[0%s%s%s%s%s%s%sm",
 						attr & A_BOLD ? ";1" : "",
 						attr & A_DIM ? ";2" : "",
+						attr & A_ITALIC ? ";3" : "",
 						attr & A_UNDERLINE ? ";4" : "",
 						attr & A_BLINK ? ";5" : "",
 						attr & A_REVERSE ? ";7" : "",
@@ -1926,27 +3710,41 @@ size_t vt_content_get(Vt *t, char **buf, bool colored)
 						s += esclen;
 				}
 				if (!prev_cell || cell->fg != prev_cell->fg || cell->attr != prev_cell->attr) {
-					if (cell->fg == -1)
+					int fg = color_unpack(cell->fg);
+					if (fg == -1)
 						esclen = sprintf(s, "\033[39m");
+					else if (fg & RGB_COLOR)
+						esclen = sprintf(s, "\033[38;2;%d;%d;%dm", (fg >> 16) & 0xff,
+						                 (fg >> 8) & 0xff, fg & 0xff);
 					else
-						esclen = sprintf(s, "\033[38;5;%dm", cell->fg);
+						esclen = sprintf(s, "\033[38;5;%dm", fg);
 					if (esclen > 0)
 						s += esclen;
 				}
 				if (!prev_cell || cell->bg != prev_cell->bg || cell->attr != prev_cell->attr) {
-					if (cell->bg == -1)
+					int bg = color_unpack(cell->bg);
+					if (bg == -1)
 						esclen = sprintf(s, "\033[49m");
+					else if (bg & RGB_COLOR)
+						esclen = sprintf(s, "\033[48;2;%d;%d;%dm", (bg >> 16) & 0xff,
+						                 (bg >> 8) & 0xff, bg & 0xff);
 					else
-						esclen = sprintf(s, "\033[48;5;%dm", cell->bg);
+						esclen = sprintf(s, "\033[48;5;%dm", bg);
 					if (esclen > 0)
 						s += esclen;
 				}
-				prev_cell = cell;
+				prev = *cell;
+				prev_cell = &prev;
 			}
 			if (cell->text) {
 				len = wcrtomb(s, cell->text, &ps);
-				if (len > 0)
-					s += len;
+				if (len == (size_t)-1) {
+					/* undecodable input bytes are kept as they were */
+					memset(&ps, 0, sizeof(ps));
+					*s = cell->text < 0x100 ? cell->text : '?';
+					len = 1;
+				}
+				s += len;
 				last_non_space = s;
 			} else if (len) {
 				len = 0;
@@ -29,14 +29,20 @@
 typedef struct Vt Vt;
 typedef void (*vt_title_handler_t)(Vt*, const char *title);
 typedef void (*vt_urgent_handler_t)(Vt*);
+typedef void (*vt_damage_handler_t)(Vt*);
 
 void vt_init(void);
 void vt_shutdown(void);
 
 void vt_keytable_set(char const * const keytable_overlay[], int count);
+void vt_read_budget_set(size_t bytes);
+void vt_spill_dir_set(const char *dir);
+void vt_history_budget_set(size_t bytes);
 void vt_default_colors_set(Vt*, attr_t attrs, short fg, short bg);
 void vt_title_handler_set(Vt*, vt_title_handler_t);
 void vt_urgent_handler_set(Vt*, vt_urgent_handler_t);
+void vt_damage_handler_set(Vt*, vt_damage_handler_t);
+void vt_history_limit_set(Vt*, size_t bytes);
 void vt_data_set(Vt*, void *);
 void *vt_data_get(Vt*);
 
@@ -58,6 +64,9 @@ short vt_color_reserve(short fg, short bg);
 
 void vt_scroll(Vt*, int rows);
 void vt_noscroll(Vt*);
+void vt_viewed(Vt*);
+void vt_hide(Vt*);
+int vt_idle(void);
 
 pid_t vt_pid_get(Vt*);
 size_t vt_content_get(Vt*, char **s, bool colored);